@@ -0,0 +1,253 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "pdbdump.h"
+
+using namespace std;
+
+// MSZIP blocks decompress to at most this much, and each can refer back to the previous one.
+static constexpr size_t MSZIP_BLOCK_SIZE = 32768;
+
+namespace {
+class cab_writer {
+public:
+    cab_writer(const filesystem::path& fn, uint64_t file_off, uint64_t file_len) : fn(fn), file_off(file_off), file_len(file_len) {
+        fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd == -1)
+            throw formatted_error("Could not open {} for writing ({}).", fn.string(), strerror(errno));
+    }
+
+    ~cab_writer() {
+        close(fd);
+    }
+
+    // Takes the next piece of the folder's uncompressed data, and writes whatever part of it is our file.
+    void write(span<const uint8_t> sp) {
+        auto start = folder_off;
+        auto end = folder_off + sp.size();
+
+        folder_off = end;
+
+        if (end <= file_off || start >= file_off + file_len)
+            return;
+
+        if (start < file_off) {
+            sp = sp.subspan((size_t)(file_off - start));
+            start = file_off;
+        }
+
+        if (end > file_off + file_len)
+            sp = sp.subspan(0, (size_t)(file_off + file_len - start));
+
+        while (!sp.empty()) {
+            auto ret = ::write(fd, sp.data(), sp.size());
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret <= 0)
+                throw formatted_error("Error writing {} ({}).", fn.string(), strerror(errno));
+
+            sp = sp.subspan((size_t)ret);
+        }
+    }
+
+    bool done() const {
+        return folder_off >= file_off + file_len;
+    }
+
+private:
+    filesystem::path fn;
+    int fd;
+    uint64_t file_off, file_len;
+    uint64_t folder_off = 0;
+};
+}
+
+static span<const uint8_t> cab_range(span<const uint8_t> cab, uint64_t off, uint64_t len) {
+    if (off > cab.size() || len > cab.size() - off)
+        throw formatted_error("CAB structure at {:x} ({} bytes) was out of bounds.", off, len);
+
+    return cab.subspan((size_t)off, (size_t)len);
+}
+
+// The CAB checksum: the data XORed together as little-endian dwords, with any bytes left over at
+// the end packed big-endian.
+static uint32_t cab_checksum(span<const uint8_t> sp, uint32_t csum) {
+    while (sp.size() >= 4) {
+        csum ^= (uint32_t)sp[0] | ((uint32_t)sp[1] << 8) | ((uint32_t)sp[2] << 16) | ((uint32_t)sp[3] << 24);
+        sp = sp.subspan(4);
+    }
+
+    uint32_t rest = 0;
+
+    for (auto b : sp) {
+        rest = (rest << 8) | b;
+    }
+
+    return csum ^ rest;
+}
+
+// Returns the data of the CFDATA block at off, and moves off on to the next one.
+static span<const uint8_t> cab_block(span<const uint8_t> cab, uint64_t& off, uint8_t data_reserve, const CFDATA*& d) {
+    d = (const CFDATA*)cab_range(cab, off, sizeof(CFDATA)).data();
+
+    auto data = cab_range(cab, off + sizeof(CFDATA) + data_reserve, d->cbData);
+
+    off += sizeof(CFDATA) + data_reserve + d->cbData;
+
+    // a checksum of 0 means there isn't one; it covers the data, then cbData and cbUncomp, but not the reserved area
+    if (d->csum != 0) {
+        auto csum = cab_checksum(span((const uint8_t*)&d->cbData, sizeof(CFDATA) - offsetof(CFDATA, cbData)),
+                                 cab_checksum(data, 0));
+
+        if (csum != d->csum)
+            throw formatted_error("CFDATA checksum was {:08x}, expected {:08x}.", csum, d->csum);
+    }
+
+    return data;
+}
+
+static void extract_mszip(span<const uint8_t> cab, uint64_t off, unsigned int num_blocks, uint8_t data_reserve,
+                          cab_writer& w) {
+    z_stream strm;
+    vector<uint8_t> out(MSZIP_BLOCK_SIZE), dict;
+
+    memset(&strm, 0, sizeof(strm));
+
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+        throw runtime_error("inflateInit2 failed.");
+
+    try {
+        for (unsigned int i = 0; i < num_blocks && !w.done(); i++) {
+            const CFDATA* d;
+            auto data = cab_block(cab, off, data_reserve, d);
+
+            if (d->cbUncomp > MSZIP_BLOCK_SIZE)
+                throw formatted_error("MSZIP block was {} bytes, expected at most {}.", d->cbUncomp, MSZIP_BLOCK_SIZE);
+
+            if (data.size() < 2 || data[0] != 'C' || data[1] != 'K')
+                throw runtime_error("MSZIP block did not begin with CK.");
+
+            // Each block is a complete deflate stream, but can use the previous block as its history.
+
+            if (inflateReset(&strm) != Z_OK)
+                throw runtime_error("inflateReset failed.");
+
+            if (!dict.empty() && inflateSetDictionary(&strm, dict.data(), (uInt)dict.size()) != Z_OK)
+                throw runtime_error("inflateSetDictionary failed.");
+
+            strm.next_in = (Bytef*)data.data() + 2;
+            strm.avail_in = (uInt)(data.size() - 2);
+            strm.next_out = out.data();
+            strm.avail_out = (uInt)out.size();
+
+            auto ret = inflate(&strm, Z_FINISH);
+
+            if (ret != Z_STREAM_END)
+                throw formatted_error("inflate failed ({}).", strm.msg ? strm.msg : to_string(ret));
+
+            auto len = out.size() - strm.avail_out;
+
+            if (len != d->cbUncomp)
+                throw formatted_error("MSZIP block decompressed to {} bytes, expected {}.", len, d->cbUncomp);
+
+            w.write(span(out.data(), len));
+
+            dict.assign(out.begin(), out.begin() + (ptrdiff_t)len);
+        }
+    } catch (...) {
+        inflateEnd(&strm);
+        throw;
+    }
+
+    inflateEnd(&strm);
+}
+
+static void extract_stored(span<const uint8_t> cab, uint64_t off, unsigned int num_blocks, uint8_t data_reserve,
+                           cab_writer& w) {
+    for (unsigned int i = 0; i < num_blocks && !w.done(); i++) {
+        const CFDATA* d;
+
+        w.write(cab_block(cab, off, data_reserve, d));
+    }
+}
+
+// Extracts the first file from a cabinet, which is how symbol servers compress PDBs.
+void extract_cab(const filesystem::path& cab_fn, const filesystem::path& out_fn) {
+    mapped_file f(cab_fn);
+    auto cab = f.data();
+
+    const auto& h = *(const CFHEADER*)cab_range(cab, 0, sizeof(CFHEADER)).data();
+
+    if (h.signature != CAB_SIGNATURE)
+        throw formatted_error("{} was not a cabinet file.", cab_fn.string());
+
+    if (h.flags & (cfhdrPREV_CABINET | cfhdrNEXT_CABINET))
+        throw formatted_error("{} is part of a multi-cabinet set, which is not supported.", cab_fn.string());
+
+    if (h.cFolders == 0 || h.cFiles == 0)
+        throw formatted_error("{} was empty.", cab_fn.string());
+
+    uint64_t off = sizeof(CFHEADER);
+    uint8_t folder_reserve = 0, data_reserve = 0;
+
+    if (h.flags & cfhdrRESERVE_PRESENT) {
+        auto r = cab_range(cab, off, 4);
+        auto header_reserve = *(const uint16_t*)r.data();
+
+        folder_reserve = r[2];
+        data_reserve = r[3];
+        off += 4 + header_reserve;
+    }
+
+    auto folders_off = off;
+    const auto& file = *(const CFFILE*)cab_range(cab, h.coffFiles, sizeof(CFFILE)).data();
+
+    if (file.iFolder >= h.cFolders)
+        throw formatted_error("File folder {} was out of range, expected less than {}.", file.iFolder, h.cFolders);
+
+    const auto& folder = *(const CFFOLDER*)cab_range(cab, folders_off + (file.iFolder * (sizeof(CFFOLDER) + folder_reserve)),
+                                                     sizeof(CFFOLDER)).data();
+
+    auto tmp_fn = out_fn;
+
+    tmp_fn += ".cab.tmp";
+
+    try {
+        {
+            cab_writer w(tmp_fn, file.uoffFolderStart, file.cbFile);
+
+            switch (folder.typeCompress & tcompMASK_TYPE) {
+                case tcompTYPE_NONE:
+                    extract_stored(cab, folder.coffCabStart, folder.cCFData, data_reserve, w);
+                    break;
+
+                case tcompTYPE_MSZIP:
+                    extract_mszip(cab, folder.coffCabStart, folder.cCFData, data_reserve, w);
+                    break;
+
+                case tcompTYPE_QUANTUM:
+                    throw unsupported_cab_error("Quantum-compressed cabinets are not supported.");
+
+                case tcompTYPE_LZX:
+                    throw unsupported_cab_error("LZX-compressed cabinets are not supported.");
+
+                default:
+                    throw formatted_error("Unknown cabinet compression type {:x}.", folder.typeCompress);
+            }
+
+            if (!w.done())
+                throw formatted_error("Cabinet ended before the end of its file ({} bytes).", file.cbFile);
+        }
+
+        filesystem::rename(tmp_fn, out_fn);
+    } catch (...) {
+        error_code ec;
+
+        filesystem::remove(tmp_fn, ec);
+        throw;
+    }
+}
@@ -0,0 +1,357 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <fstream>
+#include <algorithm>
+#include "pdbdump.h"
+
+using namespace std;
+
+static constexpr string_view INDEX_HEADER = "pdbdump cache index 1";
+
+static int64_t now_seconds() {
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+file_lock::file_lock(const filesystem::path& fn) : fn(fn) {
+    fd = open(fn.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        throw formatted_error("Could not open {} ({}).", fn.string(), strerror(errno));
+}
+
+file_lock::~file_lock() {
+    if (fd != -1)
+        close(fd);
+}
+
+file_lock& file_lock::operator=(file_lock&& other) noexcept {
+    if (this != &other) {
+        if (fd != -1)
+            close(fd);
+
+        fn = move(other.fn);
+        fd = other.fd;
+        other.fd = -1;
+    }
+
+    return *this;
+}
+
+// Returns false if somebody else has a conflicting lock.
+bool file_lock::try_lock(bool exclusive) {
+    while (flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == -1) {
+        if (errno == EWOULDBLOCK)
+            return false;
+
+        if (errno != EINTR)
+            throw formatted_error("Could not lock {} ({}).", fn.string(), strerror(errno));
+    }
+
+    return true;
+}
+
+void file_lock::lock(bool exclusive) {
+    while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) == -1) {
+        if (errno != EINTR)
+            throw formatted_error("Could not lock {} ({}).", fn.string(), strerror(errno));
+    }
+}
+
+pdb_cache::pdb_cache(const filesystem::path& root, uint64_t max_size) : root(root), max_size(max_size) {
+}
+
+// Returns "name/hexstr" if fn is within our store. If need_pdb is set, fn has to be the PDB itself.
+optional<string> pdb_cache::key_for(const filesystem::path& fn, bool need_pdb) const {
+    auto rel = fn.lexically_relative(root);
+    vector<filesystem::path> parts(rel.begin(), rel.end());
+
+    if (parts.size() != 3 || parts[0] == ".." || parts[0] == "." || parts[0].empty())
+        return nullopt;
+
+    if (need_pdb && parts[2] != parts[0])
+        return nullopt;
+
+    return (parts[0] / parts[1]).string();
+}
+
+uint64_t pdb_cache::dir_size(const string& key) const {
+    uint64_t size = 0;
+    error_code ec;
+
+    for (const auto& de : filesystem::directory_iterator(root / key, ec)) {
+        if (de.is_regular_file(ec))
+            size += de.file_size(ec);
+    }
+
+    return size;
+}
+
+void pdb_cache::scan(unordered_map<string, entry>& ents) const {
+    error_code ec;
+
+    for (const auto& name_dir : filesystem::directory_iterator(root, ec)) {
+        if (!name_dir.is_directory(ec))
+            continue;
+
+        for (const auto& hash_dir : filesystem::directory_iterator(name_dir.path(), ec)) {
+            auto pdb_fn = hash_dir.path() / name_dir.path().filename();
+
+            if (!filesystem::exists(pdb_fn, ec))
+                continue;
+
+            auto key = (name_dir.path().filename() / hash_dir.path().filename()).string();
+            auto mtime = filesystem::last_write_time(pdb_fn, ec);
+            auto secs = chrono::duration_cast<chrono::seconds>(chrono::file_clock::to_sys(mtime).time_since_epoch()).count();
+
+            ents[key] = { dir_size(key), secs };
+        }
+    }
+}
+
+void pdb_cache::read_index(unordered_map<string, entry>& ents) const {
+    ifstream f(root / "index");
+
+    // no index yet, so build one from what's already there
+    if (!f.good()) {
+        scan(ents);
+        return;
+    }
+
+    string line;
+
+    if (!getline(f, line) || line != INDEX_HEADER) {
+        scan(ents);
+        return;
+    }
+
+    while (getline(f, line)) {
+        int64_t last_access;
+        uint64_t size;
+        char key[1024];
+
+        if (sscanf(line.c_str(), "%ld %lu %1023[^\n]", &last_access, &size, key) != 3)
+            continue;
+
+        ents[key] = { size, last_access };
+    }
+}
+
+void pdb_cache::load() {
+    if (loaded)
+        return;
+
+    read_index(entries);
+    loaded = true;
+}
+
+bool pdb_cache::contains(const filesystem::path& fn) {
+    auto key = key_for(fn, true);
+
+    if (!key)
+        return filesystem::exists(fn);
+
+    lock_guard lock(mut);
+
+    load();
+
+    if (auto it = entries.find(*key); it != entries.end()) {
+        it->second.last_access = now_seconds();
+        it->second.dirty = true;
+        return true;
+    }
+
+    // Misses are about to go to the network anyway, so it's cheap to check whether something
+    // else has put it there since we read the index.
+
+    if (!filesystem::exists(fn))
+        return false;
+
+    entries[*key] = { dir_size(*key), now_seconds(), true };
+
+    return true;
+}
+
+void pdb_cache::add(const filesystem::path& fn) {
+    auto key = key_for(fn, false);
+
+    if (!key)
+        return;
+
+    auto name = filesystem::path{*key}.parent_path();
+
+    // only complete PDBs get an entry
+    if (!filesystem::exists(root / *key / name))
+        return;
+
+    lock_guard lock(mut);
+
+    load();
+
+    entries[*key] = { dir_size(*key), now_seconds(), true };
+}
+
+// Takes a reader lock on the entry fn is in, so that it can't be evicted while we use it. Returns
+// nullopt if it's already gone, e.g. if another process evicted it after we read the index.
+optional<file_lock> pdb_cache::lock_entry(const filesystem::path& fn) {
+    auto key = key_for(fn, false);
+
+    if (!key) {
+        if (!filesystem::exists(fn))
+            return nullopt;
+
+        return file_lock{};
+    }
+
+    try {
+        file_lock l(root / *key / ".lock");
+
+        l.lock(false);
+
+        // evict removes the files while holding the exclusive lock, so if it's there now it'll stay
+        if (filesystem::exists(fn))
+            return l;
+    } catch (...) {
+        // the directory's gone
+    }
+
+    lock_guard lock(mut);
+
+    entries.erase(*key);
+
+    return nullopt;
+}
+
+// Removes an entry, unless somebody's using it.
+bool pdb_cache::evict(const string& key) {
+    auto dir = root / key;
+    auto lock_fn = dir / ".lock";
+    file_lock l;
+    error_code ec;
+
+    try {
+        l = file_lock(lock_fn);
+    } catch (...) {
+        return !filesystem::exists(dir, ec);
+    }
+
+    if (!l.try_lock(true))
+        return false;
+
+    // Leave it alone if somebody's fetching into it.
+
+    auto fill_fn = dir / filesystem::path{key}.parent_path();
+    file_lock fill;
+
+    fill_fn += ".lock";
+
+    try {
+        fill = file_lock(fill_fn);
+    } catch (...) {
+        return false;
+    }
+
+    if (!fill.try_lock(true))
+        return false;
+
+    // Anyone waiting for a shared lock, or taking one after this, will find the PDB gone. Fill
+    // locks stay, as somebody waiting on one we'd removed could end up fetching at the same time
+    // as somebody who'd made a new one. This means the directory stays too, if there is one.
+
+    for (const auto& de : filesystem::directory_iterator(dir, ec)) {
+        if (de.path().filename() != ".lock" && de.path().extension() != ".lock")
+            filesystem::remove(de.path(), ec);
+    }
+
+    filesystem::remove(lock_fn, ec);
+    filesystem::remove(dir, ec); // only succeeds if empty
+    filesystem::remove(dir.parent_path(), ec);
+
+    return true;
+}
+
+void pdb_cache::save() {
+    lock_guard lock(mut);
+
+    if (!loaded && max_size == 0)
+        return;
+
+    filesystem::create_directories(root);
+
+    file_lock l(root / "index.lock");
+
+    l.lock(true);
+
+    // Other processes may have changed the index since we read it, so we merge our
+    // changes into what's there now.
+
+    unordered_map<string, entry> ents;
+
+    read_index(ents);
+
+    for (const auto& [key, e] : entries) {
+        if (!e.dirty)
+            continue;
+
+        if (auto it = ents.find(key); it != ents.end()) {
+            it->second.size = e.size;
+            it->second.last_access = max(it->second.last_access, e.last_access);
+        } else
+            ents[key] = { e.size, e.last_access };
+    }
+
+    uint64_t total = 0;
+
+    for (const auto& [key, e] : ents) {
+        total += e.size;
+    }
+
+    if (max_size != 0 && total > max_size) {
+        vector<pair<int64_t, string>> lru;
+
+        for (const auto& [key, e] : ents) {
+            lru.emplace_back(e.last_access, key);
+        }
+
+        sort(lru.begin(), lru.end());
+
+        for (const auto& [last_access, key] : lru) {
+            if (total <= max_size)
+                break;
+
+            auto size = ents.at(key).size;
+
+            if (evict(key)) {
+                ents.erase(key);
+                total -= size;
+            }
+        }
+    }
+
+    auto tmp_fn = root / fmt::format("index.{}.tmp", getpid());
+
+    {
+        ofstream f(tmp_fn);
+
+        if (!f.good())
+            throw formatted_error("Could not open {} for writing.", tmp_fn.string());
+
+        f << INDEX_HEADER << "\n";
+
+        for (const auto& [key, e] : ents) {
+            f << e.last_access << " " << e.size << " " << key << "\n";
+        }
+
+        if (!f.good()) {
+            f.close();
+            filesystem::remove(tmp_fn);
+            throw formatted_error("Error writing {}.", tmp_fn.string());
+        }
+    }
+
+    filesystem::rename(tmp_fn, root / "index");
+
+    entries = move(ents);
+    loaded = true;
+}
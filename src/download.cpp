@@ -0,0 +1,464 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <future>
+#include <random>
+#include <sys/stat.h>
+#include "pdbdump.h"
+
+using namespace std;
+
+// Transfers beyond this many get queued up by curl until a connection is free.
+static constexpr long MAX_TRANSFERS = 16;
+
+// Transient failures get retried after 1, 2, 4... seconds, up to this many times.
+static constexpr unsigned int MAX_RETRIES = 5;
+static constexpr auto RETRY_BASE_DELAY = chrono::seconds(1);
+static constexpr auto RETRY_MAX_DELAY = chrono::seconds(30);
+
+// A transfer that goes slower than this many bytes a second for STALL_TIME gets given up on.
+static constexpr long STALL_SPEED = 1;
+static constexpr long STALL_TIME = 60;
+
+struct download_manager::transfer {
+    string url;
+    filesystem::path dest;
+    filesystem::path part_fn; // where we download to, before renaming to dest
+    vector<callback> done;
+    CURL* curl = nullptr;
+    int fd = -1;
+    uint64_t off = 0;
+    uint64_t resume_from = 0;
+    string range;
+    long code = 0;
+    unsigned int attempts = 0;
+    bool write_error = false;
+    char errbuf[CURL_ERROR_SIZE];
+};
+
+namespace {
+class retryable_error : public runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
+}
+
+download_manager& download_manager::get() {
+    static download_manager dm;
+
+    return dm;
+}
+
+download_manager::download_manager() {
+    auto res = curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    if (res != CURLE_OK)
+        throw formatted_error("Failed to initialize cURL ({}).", curl_easy_strerror(res));
+
+    multi = curl_multi_init();
+    sh = curl_share_init();
+
+    if (!multi || !sh) {
+        if (multi)
+            curl_multi_cleanup(multi);
+
+        if (sh)
+            curl_share_cleanup(sh);
+
+        curl_global_cleanup();
+        throw runtime_error("Failed to initialize cURL.");
+    }
+
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, MAX_TRANSFERS);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_TRANSFERS);
+
+    // Handles for partial downloads use the share too, from other threads, so it needs locking.
+
+    curl_share_setopt(sh, CURLSHOPT_LOCKFUNC, +[](CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        ((download_manager*)userptr)->share_locks[data].lock();
+    });
+    curl_share_setopt(sh, CURLSHOPT_UNLOCKFUNC, +[](CURL*, curl_lock_data data, void* userptr) {
+        ((download_manager*)userptr)->share_locks[data].unlock();
+    });
+    curl_share_setopt(sh, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    thread = jthread([this]() {
+        run();
+    });
+}
+
+download_manager::~download_manager() {
+    {
+        lock_guard lock(mut);
+
+        stopping = true;
+    }
+
+    curl_multi_wakeup(multi);
+    thread = jthread();
+
+    curl_multi_cleanup(multi);
+    curl_share_cleanup(sh);
+    curl_global_cleanup();
+}
+
+void download_manager::share(CURL* curl) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, sh);
+}
+
+void download_manager::start(const string& url, const filesystem::path& dest, callback done) {
+    {
+        lock_guard lock(mut);
+
+        // if something's already downloading to the same place, just wait for that
+        if (auto it = by_dest.find(dest.string()); it != by_dest.end()) {
+            it->second->done.push_back(move(done));
+            return;
+        }
+
+        auto t = make_unique<transfer>();
+
+        t->url = url;
+        t->dest = dest;
+        t->part_fn = dest;
+        t->part_fn += ".part";
+        t->done.push_back(move(done));
+
+        by_dest.emplace(dest.string(), t.get());
+        queued.push_back(move(t));
+    }
+
+    curl_multi_wakeup(multi);
+}
+
+void download_manager::download(const string& url, const filesystem::path& dest) {
+    promise<void> p;
+
+    start(url, dest, [&p](exception_ptr e) {
+        if (e)
+            p.set_exception(e);
+        else
+            p.set_value();
+    });
+
+    p.get_future().get();
+}
+
+size_t download_manager::write_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    auto& t = *(transfer*)userdata;
+    auto len = size * nmemb;
+
+    if (t.code == 0) {
+        curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &t.code);
+
+        // server ignored our Range, and is sending the whole thing
+        if (t.code == 200 && t.off != 0) {
+            if (ftruncate(t.fd, 0) == -1) {
+                t.write_error = true;
+                return 0;
+            }
+
+            t.off = 0;
+        }
+    }
+
+    if (t.code != 200 && t.code != 206) // discard error page
+        return size * nmemb;
+
+    while (len > 0) {
+        auto ret = pwrite(t.fd, ptr, len, (off_t)t.off);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            t.write_error = true;
+            return 0;
+        }
+
+        ptr += ret;
+        len -= (size_t)ret;
+        t.off += (uint64_t)ret;
+    }
+
+    return size * nmemb;
+}
+
+// t is only moved from once it's succeeded
+void download_manager::add_transfer(unique_ptr<transfer>& t) {
+    // If there's a .part file left over from before, we pick up where it left off.
+
+    t->fd = open(t->part_fn.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (t->fd == -1)
+        throw formatted_error("Could not open {} for writing ({}).", t->part_fn.string(), strerror(errno));
+
+    struct stat st;
+
+    if (fstat(t->fd, &st) == -1)
+        throw formatted_error("fstat failed on {} ({}).", t->part_fn.string(), strerror(errno));
+
+    t->resume_from = t->off = (uint64_t)st.st_size;
+    t->code = 0;
+    t->write_error = false;
+    t->curl = curl_easy_init();
+
+    if (!t->curl)
+        throw runtime_error("Failed to initialize cURL.");
+
+    t->errbuf[0] = 0;
+
+    curl_easy_setopt(t->curl, CURLOPT_URL, t->url.c_str());
+    curl_easy_setopt(t->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_LIMIT, STALL_SPEED);
+    curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_TIME, STALL_TIME);
+
+    // Ranges are of the encoded data, so we can only ask for compression when starting afresh.
+    // If that gets interrupted, the resumed part will come unencoded, which is what we've got on disk.
+    // We use CURLOPT_RANGE rather than CURLOPT_RESUME_FROM_LARGE, as the latter fails if the
+    // server sends the whole file, whereas we can just start again.
+    if (t->resume_from != 0) {
+        t->range = fmt::format("{}-", t->resume_from);
+        curl_easy_setopt(t->curl, CURLOPT_RANGE, t->range.c_str());
+    } else
+        curl_easy_setopt(t->curl, CURLOPT_ACCEPT_ENCODING, ""); // everything that libcurl supports
+
+    curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, t.get());
+    curl_easy_setopt(t->curl, CURLOPT_ERRORBUFFER, t->errbuf);
+    curl_easy_setopt(t->curl, CURLOPT_SHARE, sh);
+
+    if (auto res = curl_multi_add_handle(multi, t->curl); res != CURLM_OK)
+        throw runtime_error(curl_multi_strerror(res));
+
+    auto curl = t->curl;
+
+    active.emplace(curl, move(t));
+}
+
+void download_manager::complete(transfer& t, exception_ptr e) {
+    for (auto& cb : t.done) {
+        cb(e);
+    }
+}
+
+static bool retryable_curl_error(CURLcode res) {
+    switch (res) {
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+        case CURLE_SSL_CONNECT_ERROR:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool retryable_http_code(long code) {
+    return code == 408 || code == 429 || (code >= 500 && code < 600);
+}
+
+void download_manager::finish_transfer(CURL* curl, CURLcode res) {
+    auto it = active.find(curl);
+    auto t = move(it->second);
+    exception_ptr e;
+    bool retry = false;
+
+    active.erase(it);
+    curl_multi_remove_handle(multi, curl);
+
+    try {
+        if (t->write_error)
+            throw formatted_error("Error writing {} ({}).", t->part_fn.string(), strerror(errno));
+
+        long code = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+        if (res != CURLE_OK) {
+            auto msg = t->errbuf[0] ? string{t->errbuf} : string{curl_easy_strerror(res)};
+
+            if (retryable_curl_error(res))
+                throw retryable_error(msg);
+            else
+                throw runtime_error(msg);
+        }
+
+        // what we've got is no good - start again from the beginning
+        if (code == 416) {
+            if (ftruncate(t->fd, 0) == -1)
+                throw formatted_error("ftruncate failed ({}).", strerror(errno));
+
+            throw retryable_error("HTTP error 416");
+        }
+
+        if (retryable_http_code(code))
+            throw retryable_error(fmt::format("HTTP error {}", code));
+
+        if (code >= 400)
+            throw formatted_error("HTTP error {}", code);
+
+        if (fsync(t->fd) == -1)
+            throw formatted_error("fsync failed on {} ({}).", t->part_fn.string(), strerror(errno));
+    } catch (const retryable_error& ex) {
+        e = current_exception();
+        retry = t->attempts < MAX_RETRIES;
+
+        if (retry)
+            fmt::print(stderr, "Error downloading {} ({}), retrying.\n", t->url, ex.what());
+    } catch (...) {
+        e = current_exception();
+    }
+
+    curl_easy_cleanup(curl);
+    t->curl = nullptr;
+    close(t->fd);
+    t->fd = -1;
+
+    if (retry) {
+        // exponential backoff, with some jitter so everything doesn't retry at once
+        static thread_local minstd_rand rng{random_device{}()};
+
+        auto delay = min(RETRY_BASE_DELAY * (1u << t->attempts), RETRY_MAX_DELAY);
+        auto jitter = chrono::milliseconds(uniform_int_distribution<long>(0, 250)(rng));
+
+        t->attempts++;
+        waiting.emplace_back(chrono::steady_clock::now() + delay + jitter, move(t));
+
+        return;
+    }
+
+    if (!e) {
+        error_code ec;
+
+        filesystem::rename(t->part_fn, t->dest, ec);
+
+        if (ec)
+            e = make_exception_ptr(formatted_error("Could not rename {} to {} ({}).", t->part_fn.string(), t->dest.string(), ec.message()));
+    } else if (t->off == 0) {
+        // don't leave an empty file behind after e.g. a 404
+        error_code ec;
+
+        filesystem::remove(t->part_fn, ec);
+    }
+
+    {
+        lock_guard lock(mut);
+
+        by_dest.erase(t->dest.string());
+    }
+
+    complete(*t, e);
+}
+
+void download_manager::run() {
+    while (true) {
+        vector<unique_ptr<transfer>> to_add;
+
+        {
+            lock_guard lock(mut);
+
+            if (stopping)
+                break;
+
+            to_add.swap(queued);
+        }
+
+        auto now = chrono::steady_clock::now();
+
+        for (auto it = waiting.begin(); it != waiting.end(); ) {
+            if (it->first <= now) {
+                to_add.push_back(move(it->second));
+                it = waiting.erase(it);
+            } else
+                it++;
+        }
+
+        for (auto& t : to_add) {
+            auto dest = t->dest.string();
+
+            try {
+                add_transfer(t);
+            } catch (...) {
+                if (t->curl)
+                    curl_easy_cleanup(t->curl);
+
+                if (t->fd != -1)
+                    close(t->fd);
+
+                if (t->off == 0) {
+                    error_code ec;
+
+                    filesystem::remove(t->part_fn, ec);
+                }
+
+                {
+                    lock_guard lock(mut);
+
+                    by_dest.erase(dest);
+                }
+
+                complete(*t, current_exception());
+            }
+        }
+
+        int running;
+
+        curl_multi_perform(multi, &running);
+
+        int msgs_left;
+
+        while (auto msg = curl_multi_info_read(multi, &msgs_left)) {
+            if (msg->msg == CURLMSG_DONE)
+                finish_transfer(msg->easy_handle, msg->data.result);
+        }
+
+        int timeout = 1000;
+
+        for (const auto& w : waiting) {
+            auto ms = chrono::duration_cast<chrono::milliseconds>(w.first - chrono::steady_clock::now()).count();
+
+            timeout = (int)clamp<decltype(ms)>(ms, 0, timeout);
+        }
+
+        curl_multi_poll(multi, nullptr, 0, timeout, nullptr);
+    }
+
+    // shutting down - anything still outstanding fails
+
+    auto e = make_exception_ptr(runtime_error("Download cancelled."));
+
+    for (auto& [curl, t] : active) {
+        curl_multi_remove_handle(multi, curl);
+        curl_easy_cleanup(curl);
+        close(t->fd);
+        complete(*t, e);
+    }
+
+    active.clear();
+
+    for (auto& w : waiting) {
+        complete(*w.second, e);
+    }
+
+    waiting.clear();
+
+    lock_guard lock(mut);
+
+    for (auto& t : queued) {
+        complete(*t, e);
+    }
+
+    queued.clear();
+    by_dest.clear();
+}
@@ -0,0 +1,185 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pdbdump.h"
+
+using namespace std;
+
+mapped_file::mapped_file(const filesystem::path& fn) {
+    int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        throw formatted_error("Could not open {} ({}).", fn.string(), strerror(errno));
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        auto err = errno;
+        close(fd);
+        throw formatted_error("Could not stat {} ({}).", fn.string(), strerror(err));
+    }
+
+    len = (size_t)st.st_size;
+
+    if (len == 0) {
+        close(fd);
+        throw formatted_error("{} was empty.", fn.string());
+    }
+
+    auto addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (addr == MAP_FAILED)
+        throw formatted_error("Could not map {} ({}).", fn.string(), strerror(errno));
+
+    ptr = (const uint8_t*)addr;
+}
+
+mapped_file::~mapped_file() {
+    if (ptr)
+        munmap((void*)ptr, len);
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept {
+    swap(ptr, other.ptr);
+    swap(len, other.len);
+}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept {
+    swap(ptr, other.ptr);
+    swap(len, other.len);
+
+    return *this;
+}
+
+bool msf::is_msf(span<const uint8_t> data) {
+    if (data.size() < sizeof(msf_superblock))
+        return false;
+
+    return !memcmp(data.data(), msf_magic, sizeof(msf_magic));
+}
+
+msf::msf(mapped_file&& f) : f(move(f)) {
+    auto data = this->f.data();
+
+    if (!is_msf(data))
+        throw runtime_error("File was not an MSF file.");
+
+    const auto& sb = *(msf_superblock*)data.data();
+
+    switch (sb.block_size) {
+        case 512:
+        case 1024:
+        case 2048:
+        case 4096:
+            break;
+
+        default:
+            throw formatted_error("Unsupported MSF block size {}.", sb.block_size);
+    }
+
+    block_size = sb.block_size;
+
+    if ((uint64_t)sb.num_blocks * block_size > data.size())
+        throw formatted_error("MSF file was truncated ({} bytes, expected {}).", data.size(), (uint64_t)sb.num_blocks * block_size);
+
+    // the block map is a list of the blocks making up the stream directory
+
+    auto num_dir_blocks = (sb.num_directory_bytes + block_size - 1) / block_size;
+
+    if (sb.block_map_addr >= sb.num_blocks || num_dir_blocks * sizeof(uint32_t) > block_size)
+        throw formatted_error("Invalid MSF block map address {:x}.", sb.block_map_addr);
+
+    auto block_map = span((const uint32_t*)(data.data() + ((size_t)sb.block_map_addr * block_size)), num_dir_blocks);
+
+    directory = gather(block_map, sb.num_directory_bytes);
+
+    auto dir = directory.data();
+
+    if (dir.size() < sizeof(uint32_t))
+        throw runtime_error("MSF stream directory was truncated.");
+
+    auto count = *(uint32_t*)dir.data();
+
+    if (dir.size() < sizeof(uint32_t) + (count * sizeof(uint32_t)))
+        throw runtime_error("MSF stream directory was truncated.");
+
+    stream_sizes = span((const uint32_t*)dir.data() + 1, count);
+
+    auto blocks = span((const uint32_t*)dir.data() + 1 + count, (dir.size() / sizeof(uint32_t)) - 1 - count);
+
+    stream_blocks.reserve(count);
+
+    for (auto size : stream_sizes) {
+        if (size == MSF_NIL_STREAM_SIZE)
+            size = 0;
+
+        auto num = (size + block_size - 1) / block_size;
+
+        if (blocks.size() < num)
+            throw runtime_error("MSF stream directory was truncated.");
+
+        stream_blocks.emplace_back(blocks.data(), num);
+        blocks = blocks.subspan(num);
+    }
+}
+
+msf_stream msf::gather(span<const uint32_t> blocks, uint32_t size) const {
+    auto data = f.data();
+    auto num_blocks = data.size() / block_size;
+
+    for (auto b : blocks) {
+        if (b >= num_blocks)
+            throw formatted_error("MSF block {:x} was out of bounds.", b);
+    }
+
+    if (blocks.empty())
+        return {};
+
+    bool contiguous = true;
+
+    for (size_t i = 1; i < blocks.size(); i++) {
+        if (blocks[i] != blocks[i - 1] + 1) {
+            contiguous = false;
+            break;
+        }
+    }
+
+    if (contiguous)
+        return span(data.data() + ((size_t)blocks[0] * block_size), size);
+
+    vector<uint8_t> buf;
+
+    buf.resize(size);
+
+    size_t off = 0;
+
+    for (auto b : blocks) {
+        auto len = min((size_t)block_size, size - off);
+
+        memcpy(buf.data() + off, data.data() + ((size_t)b * block_size), len);
+        off += len;
+    }
+
+    return buf;
+}
+
+msf_stream msf::get_stream(uint32_t num) const {
+    if (num >= stream_sizes.size())
+        throw formatted_error("Stream {} was out of bounds ({} streams).", num, stream_sizes.size());
+
+    if (stream_sizes[num] == MSF_NIL_STREAM_SIZE)
+        return {};
+
+    return gather(stream_blocks[num], stream_sizes[num]);
+}
+
+span<const uint32_t> msf::get_stream_blocks(uint32_t num) const {
+    if (num >= stream_sizes.size())
+        throw formatted_error("Stream {} was out of bounds ({} streams).", num, stream_sizes.size());
+
+    return stream_blocks[num];
+}
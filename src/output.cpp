@@ -0,0 +1,87 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "pdbdump.h"
+
+using namespace std;
+
+// Buffers get queued up until we have at least this much, then written out with a single writev.
+static constexpr size_t FLUSH_THRESHOLD = 1024 * 1024;
+
+output_sink::output_sink(const filesystem::path& fn) {
+    fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        throw formatted_error("Could not open {} for writing ({}).", fn.string(), strerror(errno));
+
+    owns_fd = true;
+}
+
+output_sink::~output_sink() {
+    try {
+        flush();
+    } catch (...) {
+    }
+
+    if (owns_fd)
+        close(fd);
+}
+
+void output_sink::write(fmt::memory_buffer&& buf) {
+    if (buf.size() == 0)
+        return;
+
+    if (fd == -1) {
+        mem.append(buf.data(), buf.data() + buf.size());
+        return;
+    }
+
+    pending_size += buf.size();
+    pending.emplace_back(move(buf));
+
+    if (pending_size >= FLUSH_THRESHOLD)
+        flush();
+}
+
+void output_sink::flush() {
+    vector<iovec> iov;
+
+    iov.reserve(pending.size());
+
+    for (auto& b : pending) {
+        iov.push_back({b.data(), b.size()});
+    }
+
+    auto it = iov.begin();
+
+    while (it != iov.end()) {
+        auto num = (int)min(iov.end() - it, (ptrdiff_t)IOV_MAX);
+        auto ret = writev(fd, &*it, num);
+
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            throw formatted_error("Error writing output ({}).", strerror(errno));
+        }
+
+        // skip over what was written, adjusting the first buffer on a short write
+
+        auto len = (size_t)ret;
+
+        while (it != iov.end() && len >= it->iov_len) {
+            len -= it->iov_len;
+            it++;
+        }
+
+        if (len > 0) {
+            it->iov_base = (uint8_t*)it->iov_base + len;
+            it->iov_len -= len;
+        }
+    }
+
+    pending.clear();
+    pending_size = 0;
+}
@@ -0,0 +1,425 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <curl/curl.h>
+#include "pdbdump.h"
+
+using namespace std;
+
+// We keep track of which parts of the file we have in 4 KB chunks, which is the largest MSF block size.
+static constexpr uint64_t CHUNK_SIZE = 4096;
+
+// Gaps of up to this many chunks get downloaded anyway, as it's quicker than doing another request.
+static constexpr uint64_t MAX_GAP = 16;
+
+// The block map is one block, so with 4 KB blocks the stream directory can list at most 1024 * 1024
+// blocks, i.e. 4 GB.
+static constexpr uint64_t MAX_MSF_SIZE = 0x100000000;
+
+class partial_download {
+public:
+    partial_download(const string& url, const filesystem::path& fn);
+    ~partial_download();
+
+    void fetch(span<const pair<uint64_t, uint64_t>> ranges);
+    void read(uint64_t off, span<uint8_t> buf);
+    void set_size(uint64_t new_size);
+
+    bool empty() const {
+        return none_of(present.begin(), present.end(), [](bool b) { return b; });
+    }
+
+    bool complete() const {
+        return size != 0 && all_of(present.begin(), present.end(), [](bool b) { return b; });
+    }
+
+private:
+    void fetch_run(uint64_t start, uint64_t end);
+    void save_map();
+
+    string url;
+    filesystem::path map_fn;
+    int fd = -1;
+    CURL* curl = nullptr;
+    uint64_t size = 0;
+    vector<bool> present;
+};
+
+partial_download::partial_download(const string& url, const filesystem::path& fn) : url(url) {
+    map_fn = fn;
+    map_fn += ".map";
+
+    fd = open(fn.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        throw formatted_error("Could not open {} ({}).", fn.string(), strerror(errno));
+
+    // The map file is the size of the complete file, followed by a bitmap of the chunks we have.
+    // As we always write the data before the map, it can never claim a chunk we don't have.
+
+    if (int mfd = open(map_fn.c_str(), O_RDONLY | O_CLOEXEC); mfd != -1) {
+        vector<uint8_t> buf;
+        uint64_t map_size;
+
+        if (::read(mfd, &map_size, sizeof(map_size)) == sizeof(map_size)) {
+            buf.resize((size_t)((map_size + (CHUNK_SIZE * 8) - 1) / (CHUNK_SIZE * 8)));
+
+            if (::read(mfd, buf.data(), buf.size()) == (ssize_t)buf.size()) {
+                size = map_size;
+                present.resize((size_t)((size + CHUNK_SIZE - 1) / CHUNK_SIZE));
+
+                for (size_t i = 0; i < present.size(); i++) {
+                    present[i] = buf[i / 8] & (1 << (i % 8));
+                }
+            }
+        }
+
+        ::close(mfd);
+    }
+
+    download_manager::get(); // makes sure cURL is initialized
+
+    curl = curl_easy_init();
+
+    if (!curl) {
+        ::close(fd);
+        throw runtime_error("Failed to initialize cURL.");
+    }
+}
+
+partial_download::~partial_download() {
+    curl_easy_cleanup(curl);
+    ::close(fd);
+}
+
+void partial_download::save_map() {
+    vector<uint8_t> buf;
+
+    buf.resize(sizeof(uint64_t) + ((present.size() + 7) / 8));
+
+    *(uint64_t*)buf.data() = size;
+
+    for (size_t i = 0; i < present.size(); i++) {
+        if (present[i])
+            buf[sizeof(uint64_t) + (i / 8)] |= (uint8_t)(1 << (i % 8));
+    }
+
+    int mfd = open(map_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (mfd == -1)
+        throw formatted_error("Could not open {} ({}).", map_fn.string(), strerror(errno));
+
+    auto ret = write(mfd, buf.data(), buf.size());
+
+    ::close(mfd);
+
+    if (ret != (ssize_t)buf.size())
+        throw formatted_error("Could not write {}.", map_fn.string());
+}
+
+void partial_download::set_size(uint64_t new_size) {
+    if (size == new_size)
+        return;
+
+    if (ftruncate(fd, (off_t)new_size) == -1)
+        throw formatted_error("ftruncate failed ({}).", strerror(errno));
+
+    size = new_size;
+    present.resize((size_t)((size + CHUNK_SIZE - 1) / CHUNK_SIZE));
+
+    save_map();
+}
+
+void partial_download::read(uint64_t off, span<uint8_t> buf) {
+    if (pread(fd, buf.data(), buf.size(), (off_t)off) != (ssize_t)buf.size())
+        throw formatted_error("Short read at offset {:x}.", off);
+}
+
+namespace {
+struct write_ctx {
+    CURL* curl;
+    int fd;
+    uint64_t off;
+    long code = 0;
+    bool whole_file = false;
+    bool error = false;
+};
+}
+
+static size_t partial_write_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    auto& ctx = *(write_ctx*)userdata;
+
+    if (ctx.code == 0) {
+        curl_easy_getinfo(ctx.curl, CURLINFO_RESPONSE_CODE, &ctx.code);
+
+        // server doesn't support ranges, and is sending us the whole thing
+        if (ctx.code == 200) {
+            ctx.whole_file = true;
+            ctx.off = 0;
+        }
+    }
+
+    if (ctx.code != 200 && ctx.code != 206) // discard error page
+        return size * nmemb;
+
+    auto len = size * nmemb;
+
+    while (len > 0) {
+        auto ret = pwrite(ctx.fd, ptr, len, (off_t)ctx.off);
+
+        if (ret <= 0) {
+            ctx.error = true;
+            return 0;
+        }
+
+        ptr += ret;
+        len -= (size_t)ret;
+        ctx.off += (uint64_t)ret;
+    }
+
+    return size * nmemb;
+}
+
+void partial_download::fetch_run(uint64_t start, uint64_t end) {
+    auto range = fmt::format("{}-{}", start * CHUNK_SIZE, size == 0 ? (end * CHUNK_SIZE) - 1 : min(end * CHUNK_SIZE, size) - 1);
+
+    write_ctx ctx{curl, fd, start * CHUNK_SIZE};
+
+    curl_easy_reset(curl);
+    download_manager::get().share(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, partial_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ctx);
+
+    auto res = curl_easy_perform(curl);
+
+    if (ctx.error)
+        throw formatted_error("Error writing partial file ({}).", strerror(errno));
+
+    if (res != CURLE_OK)
+        throw runtime_error(curl_easy_strerror(res));
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &ctx.code);
+
+    if (ctx.code >= 400)
+        throw formatted_error("HTTP error {}", ctx.code);
+
+    if (ctx.whole_file) {
+        if (ftruncate(fd, (off_t)ctx.off) == -1)
+            throw formatted_error("ftruncate failed ({}).", strerror(errno));
+
+        size = ctx.off;
+        present.assign((size_t)((size + CHUNK_SIZE - 1) / CHUNK_SIZE), true);
+    } else {
+        if (present.size() < end)
+            present.resize(end);
+
+        for (auto i = start; i < end; i++) {
+            present[i] = true;
+        }
+    }
+
+    save_map();
+}
+
+void partial_download::fetch(span<const pair<uint64_t, uint64_t>> ranges) {
+    vector<uint64_t> chunks;
+
+    for (const auto& r : ranges) {
+        if (r.second == 0)
+            continue;
+
+        for (auto c = r.first / CHUNK_SIZE; c <= (r.first + r.second - 1) / CHUNK_SIZE; c++) {
+            if (c >= present.size() || !present[c])
+                chunks.push_back(c);
+        }
+    }
+
+    sort(chunks.begin(), chunks.end());
+    chunks.erase(unique(chunks.begin(), chunks.end()), chunks.end());
+
+    // coalesce into runs of nearby chunks, so we do as few requests as possible
+
+    for (size_t i = 0; i < chunks.size(); ) {
+        auto j = i + 1;
+
+        while (j < chunks.size() && chunks[j] <= chunks[j - 1] + MAX_GAP + 1) {
+            j++;
+        }
+
+        fetch_run(chunks[i], chunks[j - 1] + 1);
+
+        if (complete())
+            return;
+
+        i = j;
+    }
+}
+
+static void fetch_streams(partial_download& pd, const filesystem::path& fn, span<const uint32_t> streams,
+                          span<const uint32_t> first_blocks = {}) {
+    msf m(mapped_file{fn});
+    vector<pair<uint64_t, uint64_t>> ranges;
+    auto block_size = m.get_block_size();
+
+    for (auto s : streams) {
+        if (s >= m.num_streams())
+            continue;
+
+        for (auto b : m.get_stream_blocks(s)) {
+            ranges.emplace_back((uint64_t)b * block_size, block_size);
+        }
+    }
+
+    // streams we only need the header of
+
+    for (auto s : first_blocks) {
+        if (s >= m.num_streams() || m.get_stream_blocks(s).empty())
+            continue;
+
+        ranges.emplace_back((uint64_t)m.get_stream_blocks(s)[0] * block_size, block_size);
+    }
+
+    pd.fetch(ranges);
+}
+
+filesystem::path fetch_pdb_streams(const string& url, const filesystem::path& fn) {
+    auto partial_fn = fn;
+
+    partial_fn += ".partial";
+
+    auto finish = [&]() {
+        filesystem::rename(partial_fn, fn);
+        filesystem::remove(partial_fn.string() + ".map");
+
+        return fn;
+    };
+
+    partial_download pd(url, partial_fn);
+
+    try {
+        pair<uint64_t, uint64_t> r{0, sizeof(msf_superblock)};
+
+        pd.fetch(span(&r, 1));
+    } catch (...) {
+        // don't leave an empty file behind if e.g. the server returned 404
+        if (pd.empty()) {
+            filesystem::remove(partial_fn);
+            filesystem::remove(partial_fn.string() + ".map");
+        }
+
+        throw;
+    }
+
+    if (pd.complete())
+        return finish();
+
+    msf_superblock sb;
+
+    pd.read(0, span((uint8_t*)&sb, sizeof(sb)));
+
+    if (!msf::is_msf(span((uint8_t*)&sb, sizeof(sb))))
+        throw formatted_error("{} was not an MSF file.", url);
+
+    // the same checks as msf::msf, as we're about to size the file from this
+
+    switch (sb.block_size) {
+        case 512:
+        case 1024:
+        case 2048:
+        case 4096:
+            break;
+
+        default:
+            throw formatted_error("Unsupported MSF block size {}.", sb.block_size);
+    }
+
+    if (sb.block_map_addr >= sb.num_blocks)
+        throw formatted_error("Invalid MSF block map address {:x}.", sb.block_map_addr);
+
+    if ((uint64_t)sb.num_blocks * sb.block_size > MAX_MSF_SIZE)
+        throw formatted_error("MSF file was {} bytes, expected at most {}.", (uint64_t)sb.num_blocks * sb.block_size, MAX_MSF_SIZE);
+
+    pd.set_size((uint64_t)sb.num_blocks * sb.block_size);
+
+    // block map, then the stream directory
+
+    {
+        pair<uint64_t, uint64_t> r{(uint64_t)sb.block_map_addr * sb.block_size, sb.block_size};
+
+        pd.fetch(span(&r, 1));
+    }
+
+    if (pd.complete())
+        return finish();
+
+    {
+        auto num_dir_blocks = (sb.num_directory_bytes + sb.block_size - 1) / sb.block_size;
+
+        if (num_dir_blocks * sizeof(uint32_t) > sb.block_size)
+            throw formatted_error("Invalid MSF block map address {:x}.", sb.block_map_addr);
+
+        vector<uint32_t> block_map;
+        vector<pair<uint64_t, uint64_t>> ranges;
+
+        block_map.resize(num_dir_blocks);
+        pd.read((uint64_t)sb.block_map_addr * sb.block_size, span((uint8_t*)block_map.data(), block_map.size() * sizeof(uint32_t)));
+
+        for (auto b : block_map) {
+            if (b >= sb.num_blocks)
+                throw formatted_error("Stream directory block {:x} was out of range.", b);
+
+            ranges.emplace_back((uint64_t)b * sb.block_size, sb.block_size);
+        }
+
+        pd.fetch(ranges);
+    }
+
+    if (pd.complete())
+        return finish();
+
+    // then the streams we actually use - the types, and the GUID and age to key the type database
+
+    {
+        static constexpr uint32_t streams[] = { PDB_STREAM_INFO, PDB_STREAM_TPI };
+        static constexpr uint32_t headers[] = { PDB_STREAM_DBI };
+
+        fetch_streams(pd, partial_fn, streams, headers);
+    }
+
+    if (pd.complete())
+        return finish();
+
+    {
+        msf m(mapped_file{partial_fn});
+        pdb_tpi_stream_header h;
+
+        if (m.num_streams() <= PDB_STREAM_TPI)
+            throw runtime_error("Could not extract types stream 0002.");
+
+        auto tpi = m.get_stream(PDB_STREAM_TPI);
+
+        if (tpi.data().size() < sizeof(h))
+            throw formatted_error("Type stream was {} bytes, expected at least {}.", tpi.data().size(), sizeof(h));
+
+        memcpy(&h, tpi.data().data(), sizeof(h));
+
+        vector<uint32_t> streams;
+
+        if (h.hash_stream_index != 0xffff)
+            streams.push_back(h.hash_stream_index);
+
+        if (h.hash_aux_stream_index != 0xffff)
+            streams.push_back(h.hash_aux_stream_index);
+
+        fetch_streams(pd, partial_fn, streams);
+    }
+
+    if (pd.complete())
+        return finish();
+
+    return partial_fn;
+}
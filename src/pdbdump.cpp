@@ -2,271 +2,633 @@
 #include <vector>
 #include <span>
 #include <filesystem>
-#include <curl/curl.h>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory_resource>
+#include <atomic>
+#include <deque>
+#include <array>
+#include <optional>
+#include <algorithm>
+#include <charconv>
+#include <string.h>
+#include <unistd.h>
+#include <fmt/compile.h>
 #include "pdbdump.h"
 
 using namespace std;
 
+// Bump allocator for the temporary data used while printing a type. Nothing is freed
+// individually: reset() rewinds it to the start, keeping the blocks for the next type.
+class arena : public pmr::memory_resource {
+public:
+    void reset() {
+        cur = 0;
+        pos = 0;
+    }
+
+    string_view copy(string_view sv) {
+        auto ptr = (char*)allocate(sv.size(), 1);
+
+        memcpy(ptr, sv.data(), sv.size());
+
+        return string_view(ptr, sv.size());
+    }
+
+    // calls func to render into a scratch buffer, then copies the result into the arena
+    template<typename F>
+    string_view build(F&& func) {
+        scratch.clear();
+        func(scratch);
+
+        return copy(string_view(scratch.data(), scratch.size()));
+    }
+
+    template<typename S, typename... Args>
+    string_view format(const S& fmt_str, Args&&... args) {
+        return build([&](fmt::memory_buffer& buf) {
+            fmt::format_to(back_inserter(buf), fmt_str, forward<Args>(args)...);
+        });
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 65536;
+
+    struct block {
+        unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        while (cur < blocks.size()) {
+            auto start = (pos + alignment - 1) & ~(alignment - 1);
+
+            if (start + bytes <= blocks[cur].size) {
+                pos = start + bytes;
+                return blocks[cur].data.get() + start;
+            }
+
+            cur++;
+            pos = 0;
+        }
+
+        auto size = max(BLOCK_SIZE, bytes + alignment);
+
+        blocks.push_back({make_unique_for_overwrite<uint8_t[]>(size), size});
+
+        // new[] returns memory aligned for any fundamental type
+        pos = bytes;
+
+        return blocks.back().data.get();
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    vector<block> blocks;
+    size_t cur = 0;
+    size_t pos = 0;
+    fmt::memory_buffer scratch;
+};
+
 struct sa {
     sa(string_view name, uint64_t off) : name(name), off(off) { }
 
-    string name;
+    string_view name;
     uint64_t off;
 };
 
+struct type_details {
+    bool has_name;
+    bool anonymous;
+    bool has_size;
+    uint32_t definition;
+    uint64_t size;
+    string_view name;
+};
+
+// an entry in a field list, with any LF_INDEX continuations followed
+struct field {
+    cv_type kind;
+    uint16_t attributes;
+    uint32_t type;
+    uint64_t value; // offset for members and base classes, value for enumerates
+    string_view name;
+    uint8_t bit_position;
+    uint8_t bit_length; // 0 if not a bitfield
+};
+
 template<typename T>
 concept union_or_struct = std::is_same_v<T, lf_union> || std::is_same_v<T, lf_class>;
 
+struct options {
+    bool partial_fetch = false;
+    bool use_type_db = true;
+    unsigned int num_threads = thread::hardware_concurrency();
+    filesystem::path output_fn;
+    bool batch = false;
+    string sym_path;
+    uint64_t cache_size = 0;
+    filesystem::path prefetch_dir;
+};
+
+struct pdb_id {
+    array<uint8_t, 16> guid;
+    uint32_t age;
+};
+
 class pdb {
 public:
-    pdb(bfd* types_stream) : types_stream(types_stream) { }
-
-    void extract_types();
-    void print_struct(span<const uint8_t> t);
-    void print_union(span<const uint8_t> t);
-    void print_enum(span<const uint8_t> t);
-    string format_member(span<const uint8_t> mt, string_view name, string_view prefix);
+    pdb(const msf& file) : file(file) { }
+
+    optional<pdb_id> read_id() const;
+    void set_type_db(const filesystem::path& fn, const pdb_id& id);
+    bool wrote_type_db() const { return type_db_written; }
+    void extract_types(unsigned int num_threads = 1);
+    void print_all_types(output_sink& out, unsigned int num_threads);
+    void print_types(uint32_t first, uint32_t last, fmt::memory_buffer& out, fmt::memory_buffer& err);
+    uint32_t num_chunks() const;
+    pair<uint32_t, uint32_t> chunk_range(uint32_t i) const;
+    void print_struct(uint32_t type, fmt::memory_buffer& out, arena& a);
+    void print_union(uint32_t type, fmt::memory_buffer& out, arena& a);
+    void print_enum(uint32_t type, fmt::memory_buffer& out);
+    void format_member(fmt::memory_buffer& out, uint32_t type, string_view name, string_view prefix);
     uint64_t get_type_size(uint32_t type);
-    string type_name(span<const uint8_t> t);
-    string arg_list_to_string(uint32_t arg_list);
-    void add_asserts(const union_or_struct auto& d, string_view name, uint64_t off, vector<sa>& asserts);
+    string_view type_name(uint32_t type);
+    void format_arg_list(fmt::memory_buffer& out, uint32_t arg_list);
+    void add_asserts(const union_or_struct auto& d, string_view name, uint64_t off, pmr::vector<sa>& asserts, arena& a);
+    uint32_t find_definition(uint32_t type);
+    void report_invalid_types(fmt::memory_buffer& err) const;
 
 private:
-    bfd* types_stream;
+    // the record for type index h.type_index_begin + i, after its length
+    span<const uint8_t> type_record(size_t i) const {
+        auto off = type_offsets[i];
+
+        return type_records.subspan(off + sizeof(uint16_t), *(uint16_t*)(type_records.data() + off));
+    }
+
+    void scan_types();
+    void check_type(size_t i) const;
+    void validate_types();
+    bool scan_types_parallel(unsigned int num_threads);
+    void load_hash_stream();
+    bool load_type_db();
+    void save_type_db();
+    void build_name_index();
+    void build_type_info();
+    uint64_t compute_type_size(uint32_t type);
+    void build_field_table();
+    span<const field> fields(uint32_t field_list);
+    void render_type_name(fmt::memory_buffer& out, uint32_t type);
+    string_view udt_name(uint32_t type);
+    bool is_anonymous(uint32_t type);
+
+    // versions of the above without the checks check_type has already done, if checked is false
+    template<bool checked> void format_member(fmt::memory_buffer& out, uint32_t type, string_view name, string_view prefix);
+    template<bool checked> void format_arg_list(fmt::memory_buffer& out, uint32_t arg_list);
+    template<bool checked> uint64_t compute_type_size(uint32_t type);
+    template<bool checked> void render_type_name(fmt::memory_buffer& out, uint32_t type);
+
+    const msf& file;
+    msf_stream tpi_stream;
+    msf_stream hash_stream;
     pdb_tpi_stream_header h;
-    vector<uint8_t> type_records;
-    vector<span<const uint8_t>> types;
+    span<const uint8_t> type_records;
+    vector<uint32_t> type_offsets; // of each record's length in type_records
+    vector<cv_type> type_kinds;
+    vector<uint8_t> type_valid; // set if the record passed check_type, so doesn't need checking again
+    vector<type_details> details;
+    vector<uint32_t> hash_bucket_offsets;
+    vector<uint32_t> hash_bucket_types;
+    vector<typedb_name> name_index_buf;
+    span<const typedb_name> name_index;
+    bool name_index_built = false;
+    filesystem::path type_db_fn;
+    pdb_id type_db_id;
+    optional<mapped_file> type_db;
+    bool type_db_written = false;
+    vector<field> field_table;
+    vector<uint32_t> field_offsets;
+    unordered_map<uint32_t, exception_ptr> field_errors;
+    vector<atomic<const string*>> type_names;
+    deque<string> type_name_storage;
+    mutex type_name_mutex;
 };
 
-static unsigned int extended_value_len(cv_type type) {
-    switch (type) {
-        case cv_type::LF_CHAR:
-            return 1;
+// Numeric leaves are a uint16_t, which is either the value itself or, if 0x8000 or over,
+// the kind of value that follows. This gives the length and signedness of each kind from
+// LF_CHAR onwards, with 0 for the ones we don't handle.
 
-        case cv_type::LF_SHORT:
-        case cv_type::LF_USHORT:
-            return 2;
+struct numeric_leaf_kind {
+    uint8_t len;
+    bool is_signed;
+};
 
-        case cv_type::LF_LONG:
-        case cv_type::LF_ULONG:
-            return 4;
+static constexpr auto numeric_leaf_kinds = []() {
+    array<numeric_leaf_kind, 16> ret{};
 
-        case cv_type::LF_QUADWORD:
-        case cv_type::LF_UQUADWORD:
-            return 8;
+    auto set = [&](cv_type kind, uint8_t len, bool is_signed) {
+        ret[(uint16_t)kind - (uint16_t)cv_type::LF_CHAR] = { len, is_signed };
+    };
 
-        default:
-            throw formatted_error("Unrecognized extended value type {}", type);
+    set(cv_type::LF_CHAR, 1, true);
+    set(cv_type::LF_SHORT, 2, true);
+    set(cv_type::LF_USHORT, 2, false);
+    set(cv_type::LF_LONG, 4, true);
+    set(cv_type::LF_ULONG, 4, false);
+    set(cv_type::LF_QUADWORD, 8, true);
+    set(cv_type::LF_UQUADWORD, 8, false);
+
+    return ret;
+}();
+
+struct numeric_leaf {
+    uint64_t value;
+    size_t len; // including the leading uint16_t
+};
+
+// kind is the record the leaf is in, for error messages
+static numeric_leaf read_numeric(span<const uint8_t> d, size_t off, cv_type kind) {
+    if (d.size() < off + sizeof(uint16_t))
+        throw formatted_error("Truncated {} ({} bytes, expected at least {})", kind, d.size(), off + sizeof(uint16_t));
+
+    auto v = *(uint16_t*)(d.data() + off);
+
+    if (v < 0x8000)
+        return { v, sizeof(uint16_t) };
+
+    auto idx = (size_t)(v - (uint16_t)cv_type::LF_CHAR);
+
+    if (idx >= numeric_leaf_kinds.size() || numeric_leaf_kinds[idx].len == 0)
+        throw formatted_error("Unrecognized extended value type {}", (cv_type)v);
+
+    const auto& nk = numeric_leaf_kinds[idx];
+
+    if (d.size() < off + sizeof(uint16_t) + nk.len)
+        throw formatted_error("Truncated {} ({} bytes, expected at least {})", kind, d.size(), off + sizeof(uint16_t) + nk.len);
+
+    uint64_t val = 0;
+
+    memcpy(&val, d.data() + off + sizeof(uint16_t), nk.len);
+
+    // sign extend
+    if (nk.is_signed) {
+        auto shift = 64 - (nk.len * 8);
+
+        val = (uint64_t)((int64_t)(val << shift) >> shift);
     }
+
+    return { val, sizeof(uint16_t) + nk.len };
+}
+
+// Where the numeric leaf is in each kind of record that has one.
+
+template<typename T>
+struct numeric_leaf_at;
+
+template<>
+struct numeric_leaf_at<lf_class> {
+    static constexpr size_t offset = offsetof(lf_class, length);
+};
+
+template<>
+struct numeric_leaf_at<lf_union> {
+    static constexpr size_t offset = offsetof(lf_union, length);
+};
+
+template<>
+struct numeric_leaf_at<lf_member> {
+    static constexpr size_t offset = offsetof(lf_member, offset);
+};
+
+template<>
+struct numeric_leaf_at<lf_enumerate> {
+    static constexpr size_t offset = offsetof(lf_enumerate, value);
+};
+
+template<>
+struct numeric_leaf_at<lf_bclass> {
+    static constexpr size_t offset = offsetof(lf_bclass, offset);
+};
+
+template<>
+struct numeric_leaf_at<lf_vbclass> {
+    static constexpr size_t offset = offsetof(lf_vbclass, vbptr_offset);
+};
+
+template<typename T>
+static numeric_leaf read_numeric(span<const uint8_t> d) {
+    return read_numeric(d, numeric_leaf_at<T>::offset, *(cv_type*)d.data());
+}
+
+static string_view read_name(span<const uint8_t> d, size_t& off, cv_type kind) {
+    auto name = string_view((char*)d.data() + off, d.size() - off);
+
+    if (auto st = name.find('\0'); st != string::npos)
+        name = name.substr(0, st);
+    else
+        throw formatted_error("No terminating null found in {} name.", kind);
+
+    off += name.size() + 1;
+
+    return name;
 }
 
-static void walk_fieldlist(span<const uint8_t> fl, invocable<span<const uint8_t>> auto func) {
+// Decodes the entry at the start of fl, returning its length including padding.
+static size_t read_field(span<const uint8_t> fl, field& f) {
     if (fl.size() < sizeof(cv_type))
         throw formatted_error("Field list was truncated.");
 
-    auto kind = *(cv_type*)fl.data();
+    size_t off;
 
-    if (kind != cv_type::LF_FIELDLIST)
-        throw formatted_error("Type kind was {}, expected LF_FIELDLIST.", kind);
+    f = {};
+    f.kind = *(cv_type*)fl.data();
 
-    fl = fl.subspan(sizeof(cv_type));
+    auto check_size = [&](size_t len) {
+        if (fl.size() < len)
+            throw formatted_error("Truncated {} ({} bytes, expected at least {})", f.kind, fl.size(), len);
+    };
 
-    while (!fl.empty()) {
-        if (fl.size() < sizeof(cv_type))
-            throw formatted_error("Field list was truncated.");
+    switch (f.kind) {
+        case cv_type::LF_ENUMERATE: {
+            check_size(offsetof(lf_enumerate, value));
 
-        auto kind = *(cv_type*)fl.data();
+            f.attributes = ((lf_enumerate*)fl.data())->attributes;
+
+            auto n = read_numeric<lf_enumerate>(fl);
+
+            f.value = n.value;
+            off = numeric_leaf_at<lf_enumerate>::offset + n.len;
+            f.name = read_name(fl, off, f.kind);
+            break;
+        }
 
-        switch (kind) {
-            case cv_type::LF_ENUMERATE: {
-                if (fl.size() < offsetof(lf_enumerate, name))
-                    throw formatted_error("Truncated LF_ENUMERATE ({} bytes, expected at least {})", fl.size(), offsetof(lf_enumerate, name));
+        case cv_type::LF_MEMBER: {
+            check_size(offsetof(lf_member, offset));
 
-                const auto& en = *(lf_enumerate*)fl.data();
+            const auto& mem = *(lf_member*)fl.data();
 
-                size_t off = offsetof(lf_enumerate, name);
+            f.attributes = mem.attributes;
+            f.type = mem.type;
 
-                if (en.value >= 0x8000) {
-                    auto extlen = extended_value_len((cv_type)en.value);
+            auto n = read_numeric<lf_member>(fl);
 
-                    if (fl.size() < off + extlen)
-                        throw formatted_error("Truncated LF_ENUMERATE ({} bytes, expected at least {})", fl.size(), off + extlen);
+            f.value = n.value;
+            off = numeric_leaf_at<lf_member>::offset + n.len;
+            f.name = read_name(fl, off, f.kind);
+            break;
+        }
 
-                    off += extlen;
-                }
+        case cv_type::LF_BCLASS: {
+            check_size(offsetof(lf_bclass, offset));
 
-                auto name = string_view((char*)&en + off, fl.size() - off);
+            const auto& bc = *(lf_bclass*)fl.data();
 
-                if (auto st = name.find('\0'); st != string::npos)
-                    name = name.substr(0, st);
-                else
-                    throw runtime_error("No terminating null found in LF_ENUMERATE name.");
+            f.attributes = bc.attributes;
+            f.type = bc.type;
 
-                auto len = off + name.size() + 1;
+            auto n = read_numeric<lf_bclass>(fl);
 
-                if (len & 3)
-                    len += 4 - (len & 3);
+            f.value = n.value;
+            off = numeric_leaf_at<lf_bclass>::offset + n.len;
+            break;
+        }
 
-                if (len > fl.size())
-                    throw formatted_error("Field list was truncated.");
+        case cv_type::LF_VBCLASS:
+        case cv_type::LF_IVBCLASS: {
+            check_size(offsetof(lf_vbclass, vbptr_offset));
 
-                func(span(fl.data(), len));
+            const auto& vbc = *(lf_vbclass*)fl.data();
 
-                fl = fl.subspan(len);
+            f.attributes = vbc.attributes;
+            f.type = vbc.base_type;
 
-                break;
-            }
+            auto n = read_numeric<lf_vbclass>(fl);
 
-            case cv_type::LF_MEMBER: {
-                if (fl.size() < offsetof(lf_member, name))
-                    throw formatted_error("Truncated LF_MEMBER ({} bytes, expected at least {})", fl.size(), offsetof(lf_member, name));
+            f.value = n.value;
+            off = numeric_leaf_at<lf_vbclass>::offset + n.len;
+            off += read_numeric(fl, off, f.kind).len; // vbtable index
+            break;
+        }
 
-                const auto& mem = *(lf_member*)fl.data();
+        case cv_type::LF_INDEX:
+            check_size(sizeof(lf_index));
 
-                size_t off = offsetof(lf_member, name);
+            f.type = ((lf_index*)fl.data())->type;
+            off = sizeof(lf_index);
+            break;
 
-                if (mem.offset >= 0x8000) {
-                    auto extlen = extended_value_len((cv_type)mem.offset);
+        case cv_type::LF_VFUNCTAB:
+            check_size(sizeof(lf_vfunctab));
 
-                    if (fl.size() < off + extlen)
-                        throw formatted_error("Truncated LF_MEMBER ({} bytes, expected at least {})", fl.size(), off + extlen);
+            f.type = ((lf_vfunctab*)fl.data())->type;
+            off = sizeof(lf_vfunctab);
+            break;
 
-                    off += extlen;
-                }
+        case cv_type::LF_STMEMBER: {
+            check_size(offsetof(lf_stmember, name));
 
-                auto name = string_view((char*)&mem + off, fl.size() - off);
+            const auto& sm = *(lf_stmember*)fl.data();
 
-                if (auto st = name.find('\0'); st != string::npos)
-                    name = name.substr(0, st);
-                else
-                    throw runtime_error("No terminating null found in LF_MEMBER name.");
+            f.attributes = sm.attributes;
+            f.type = sm.type;
 
-                auto len = off + name.size() + 1;
+            off = offsetof(lf_stmember, name);
+            f.name = read_name(fl, off, f.kind);
+            break;
+        }
 
-                if (len & 3)
-                    len += 4 - (len & 3);
+        case cv_type::LF_METHOD: {
+            check_size(offsetof(lf_method, name));
 
-                if (len > fl.size())
-                    throw formatted_error("Field list was truncated.");
+            const auto& m = *(lf_method*)fl.data();
 
-                func(span(fl.data(), len));
+            f.type = m.method_list;
+            f.value = m.count;
 
-                fl = fl.subspan(len);
+            off = offsetof(lf_method, name);
+            f.name = read_name(fl, off, f.kind);
+            break;
+        }
 
-                break;
-            }
+        case cv_type::LF_NESTTYPE: {
+            check_size(offsetof(lf_nesttype, name));
 
-            // FIXME - other types
+            f.type = ((lf_nesttype*)fl.data())->type;
 
-            default:
-                throw formatted_error("Unhandled field list subtype {}", kind);
+            off = offsetof(lf_nesttype, name);
+            f.name = read_name(fl, off, f.kind);
+            break;
+        }
+
+        case cv_type::LF_ONEMETHOD: {
+            check_size(sizeof(lf_onemethod));
+
+            const auto& m = *(lf_onemethod*)fl.data();
+
+            f.attributes = m.attributes;
+            f.type = m.type;
+
+            off = sizeof(lf_onemethod);
+
+            auto mprop = m.attributes & CV_MPROP_MASK;
+
+            if (mprop == CV_MPROP_INTRO || mprop == CV_MPROP_PUREINTRO) {
+                check_size(off + sizeof(uint32_t));
+
+                f.value = *(uint32_t*)(fl.data() + off);
+                off += sizeof(uint32_t);
+            }
+
+            f.name = read_name(fl, off, f.kind);
+            break;
         }
+
+        default:
+            throw formatted_error("Unhandled field list subtype {}", f.kind);
     }
+
+    // records are padded to a multiple of four bytes
+
+    if (off & 3)
+        off += 4 - (off & 3);
+
+    if (off > fl.size())
+        throw formatted_error("Field list was truncated.");
+
+    return off;
 }
 
-void pdb::print_enum(span<const uint8_t> t) {
-    if (t.size() < offsetof(lf_enum, name))
-        throw formatted_error("Truncated LF_ENUM ({} bytes, expected at least {})", t.size(), offsetof(lf_enum, name));
+// Decodes an LF_FIELDLIST one entry at a time, so callers can stop when they've found
+// what they want. Errors are thrown as the bad entry is reached.
+class fieldlist_range {
+public:
+    class iterator {
+    public:
+        using value_type = field;
+        using difference_type = ptrdiff_t;
 
-    const auto& en = *(struct lf_enum*)t.data();
+        iterator() = default;
 
-    // FIXME - print underlying type if not what is implied
+        explicit iterator(span<const uint8_t> rest) : rest(rest) {
+            decode();
+        }
 
-    if (en.field_list < h.type_index_begin || en.field_list >= h.type_index_end)
-        throw formatted_error("Enum field list {:x} was out of bounds.", en.field_list);
+        const field& operator*() const {
+            return f;
+        }
 
-    const auto& fl = types[en.field_list - h.type_index_begin];
+        const field* operator->() const {
+            return &f;
+        }
 
-    auto name = string_view((char*)t.data() + offsetof(lf_enum, name), t.size() - offsetof(lf_enum, name));
+        iterator& operator++() {
+            rest = rest.subspan(len);
+            decode();
 
-    if (auto st = name.find('\0'); st != string::npos)
-        name = name.substr(0, st);
+            return *this;
+        }
 
-    fmt::print("enum {} {{\n", name);
+        void operator++(int) {
+            ++*this;
+        }
 
-    bool first = true;
-    int64_t exp_val = 0;
+        bool operator==(default_sentinel_t) const {
+            return rest.empty();
+        }
 
-    walk_fieldlist(fl, [&](span<const uint8_t> d) {
-        const auto& e = *(lf_enumerate*)d.data();
+    private:
+        void decode() {
+            if (!rest.empty())
+                len = read_field(rest, f);
+        }
 
-        if (e.kind != cv_type::LF_ENUMERATE)
-            throw formatted_error("Type {} found in enum field list, expected LF_ENUMERATE.", e.kind);
+        span<const uint8_t> rest;
+        field f{};
+        size_t len = 0;
+    };
 
-        size_t off = offsetof(lf_enumerate, name);
-        int64_t value;
+    explicit fieldlist_range(span<const uint8_t> fl) {
+        if (fl.size() < sizeof(cv_type))
+            throw formatted_error("Field list was truncated.");
 
-        // FIXME - distinguish between int64_t and uint64_t values?
+        auto kind = *(cv_type*)fl.data();
 
-        if (e.value < 0x8000)
-            value = e.value;
-        else {
-            switch ((cv_type)e.value) {
-                case cv_type::LF_CHAR:
-                    value = *(int8_t*)&e.name;
-                    off += sizeof(int8_t);
-                break;
+        if (kind != cv_type::LF_FIELDLIST)
+            throw formatted_error("Type kind was {}, expected LF_FIELDLIST.", kind);
 
-                case cv_type::LF_SHORT:
-                    value = *(int16_t*)&e.name;
-                    off += sizeof(int16_t);
-                break;
+        entries = fl.subspan(sizeof(cv_type));
+    }
 
-                case cv_type::LF_USHORT:
-                    value = *(uint16_t*)&e.name;
-                    off += sizeof(uint16_t);
-                break;
+    iterator begin() const {
+        return iterator(entries);
+    }
 
-                case cv_type::LF_LONG:
-                    value = *(int32_t*)&e.name;
-                    off += sizeof(int32_t);
-                break;
+    default_sentinel_t end() const {
+        return default_sentinel;
+    }
 
-                case cv_type::LF_ULONG:
-                    value = *(uint32_t*)&e.name;
-                    off += sizeof(uint32_t);
-                break;
+private:
+    span<const uint8_t> entries;
+};
 
-                case cv_type::LF_QUADWORD:
-                    value = *(int64_t*)&e.name;
-                    off += sizeof(int64_t);
-                break;
+static_assert(ranges::input_range<fieldlist_range>);
 
-                case cv_type::LF_UQUADWORD:
-                    value = *(uint64_t*)&e.name;
-                    off += sizeof(uint64_t);
-                break;
+void pdb::print_enum(uint32_t type, fmt::memory_buffer& out) {
+    auto t = type_record(type - h.type_index_begin);
+    auto valid = type_valid[type - h.type_index_begin];
 
-                default:
-                    break;
-            }
-        }
+    if (!valid && t.size() < offsetof(lf_enum, name))
+        throw formatted_error("Truncated LF_ENUM ({} bytes, expected at least {})", t.size(), offsetof(lf_enum, name));
+
+    const auto& en = *(struct lf_enum*)t.data();
+
+    // FIXME - print underlying type if not what is implied
+
+    if (en.field_list < h.type_index_begin || en.field_list >= h.type_index_end)
+        throw formatted_error("Enum field list {:x} was out of bounds.", en.field_list);
 
-        auto name = string_view((char*)&e + off, d.size() - off);
+    fmt::format_to(back_inserter(out), FMT_COMPILE("enum {} {{\n"), udt_name(type));
 
-        if (auto st = name.find('\0'); st != string::npos)
-            name = name.substr(0, st);
+    bool first = true;
+    int64_t exp_val = 0;
+
+    for (const auto& f : fields(en.field_list)) {
+        if (f.kind != cv_type::LF_ENUMERATE)
+            throw formatted_error("Type {} found in enum field list, expected LF_ENUMERATE.", f.kind);
+
+        // FIXME - distinguish between int64_t and uint64_t values?
+
+        auto value = (int64_t)f.value;
+        auto name = f.name;
 
         if (!first)
-            fmt::print(",\n");
+            fmt::format_to(back_inserter(out), FMT_COMPILE(",\n"));
 
         if (value == exp_val)
-            fmt::print("    {}", name, value);
+            fmt::format_to(back_inserter(out), FMT_COMPILE("    {}"), name, value);
         else
-            fmt::print("    {} = {}", name, value);
+            fmt::format_to(back_inserter(out), FMT_COMPILE("    {} = {}"), name, value);
 
         exp_val = value + 1;
         first = false;
-    });
+    }
 
-    fmt::print("\n}};\n\n");
+    fmt::format_to(back_inserter(out), FMT_COMPILE("\n}};\n\n"));
 }
 
-static string builtin_type(uint32_t t) {
-    if (t >> 8 == 4 || t >> 8 == 6) // pointers
-        return builtin_type(t & 0xff) + "*";
+static string_view builtin_type(uint32_t t);
 
+static string_view builtin_base_type(uint32_t t) {
     switch ((cv_builtin)t) {
         case cv_builtin::T_VOID:
             return "void";
@@ -323,67 +685,36 @@ static string builtin_type(uint32_t t) {
     throw formatted_error("Unhandled builtin type {:x}\n", t);
 }
 
-static string_view struct_name(span<const uint8_t> t) {
-    const auto& str = *(lf_class*)t.data();
-
-    size_t off = offsetof(lf_class, name);
-
-    if (str.length >= 0x8000)
-        off += extended_value_len((cv_type)str.length);
-
-    auto name = string_view((char*)&str + off, t.size() - off);
-
-    if (auto st = name.find('\0'); st != string::npos)
-        name = name.substr(0, st);
-
-    return name;
-}
-
-static uint64_t struct_length(span<const uint8_t> t) {
-    const auto& str = *(lf_class*)t.data();
-
-    if (str.length < 0x8000)
-        return str.length;
-
-    if (t.size() < offsetof(lf_class, name) + extended_value_len((cv_type)str.length))
-        throw formatted_error("Struct type was truncated.");
-
-    switch ((cv_type)str.length) {
-        case cv_type::LF_CHAR:
-            return *(int8_t*)&str.name;
+static string_view builtin_type(uint32_t t) {
+    if (t >> 8 == 4 || t >> 8 == 6) { // pointers
+        static const auto pointer_names = []() {
+            array<string, 0x100> names;
 
-        case cv_type::LF_SHORT:
-            return *(int16_t*)&str.name;
-
-        case cv_type::LF_USHORT:
-            return *(uint16_t*)&str.name;
-
-        case cv_type::LF_LONG:
-            return *(int32_t*)&str.name;
+            for (uint32_t i = 0; i < names.size(); i++) {
+                try {
+                    names[i] = string{builtin_base_type(i)} + "*";
+                } catch (const formatted_error&) {
+                }
+            }
 
-        case cv_type::LF_ULONG:
-            return *(uint32_t*)&str.name;
+            return names;
+        }();
 
-        case cv_type::LF_QUADWORD:
-            return *(int64_t*)&str.name;
+        const auto& n = pointer_names[t & 0xff];
 
-        case cv_type::LF_UQUADWORD:
-            return *(uint64_t*)&str.name;
+        if (n.empty())
+            throw formatted_error("Unhandled builtin type {:x}\n", t & 0xff);
 
-        default:
-            throw formatted_error("Could not parse struct length type {}\n", (cv_type)str.length);
+        return n;
     }
-}
-
-static string_view union_name(span<const uint8_t> t) {
-    const auto& str = *(lf_union*)t.data();
 
-    size_t off = offsetof(lf_union, name);
-
-    if (str.length >= 0x8000)
-        off += extended_value_len((cv_type)str.length);
+    return builtin_base_type(t);
+}
 
-    auto name = string_view((char*)&str + off, t.size() - off);
+template<typename T>
+static string_view udt_record_name(span<const uint8_t> t) {
+    auto off = numeric_leaf_at<T>::offset + read_numeric<T>(t).len;
+    auto name = string_view((char*)t.data() + off, t.size() - off);
 
     if (auto st = name.find('\0'); st != string::npos)
         name = name.substr(0, st);
@@ -391,138 +722,122 @@ static string_view union_name(span<const uint8_t> t) {
     return name;
 }
 
-static string_view member_name(span<const uint8_t> t) {
-    const auto& mem = *(lf_member*)t.data();
-
-    size_t off = offsetof(lf_member, name);
-
-    if (mem.offset >= 0x8000)
-        off += extended_value_len((cv_type)mem.offset);
-
-    auto name = string_view((char*)&mem + off, t.size() - off);
-
-    if (auto st = name.find('\0'); st != string::npos)
-        name = name.substr(0, st);
+static string_view struct_name(span<const uint8_t> t) {
+    return udt_record_name<lf_class>(t);
+}
 
-    return name;
+static string_view union_name(span<const uint8_t> t) {
+    return udt_record_name<lf_union>(t);
 }
 
-static uint64_t member_offset(span<const uint8_t> t) {
-    const auto& mem = *(lf_member*)t.data();
+string_view pdb::type_name(uint32_t type) {
+    auto& slot = type_names[type - h.type_index_begin];
 
-    if (mem.offset < 0x8000)
-        return mem.offset;
+    if (auto n = slot.load(memory_order_acquire))
+        return *n;
 
-    if (t.size() < offsetof(lf_union, name) + extended_value_len((cv_type)mem.offset))
-        throw formatted_error("Member type was truncated.");
+    // Render outside the lock, as this recurses. If another thread beats us to it,
+    // we use theirs so that the returned views stay valid.
 
-    switch ((cv_type)mem.offset) {
-        case cv_type::LF_CHAR:
-            return *(int8_t*)&mem.name;
+    fmt::memory_buffer buf;
 
-        case cv_type::LF_SHORT:
-            return *(int16_t*)&mem.name;
+    render_type_name(buf, type);
 
-        case cv_type::LF_USHORT:
-            return *(uint16_t*)&mem.name;
+    lock_guard lock(type_name_mutex);
 
-        case cv_type::LF_LONG:
-            return *(int32_t*)&mem.name;
+    if (auto n = slot.load(memory_order_relaxed))
+        return *n;
 
-        case cv_type::LF_ULONG:
-            return *(uint32_t*)&mem.name;
+    const auto& n = type_name_storage.emplace_back(buf.data(), buf.size());
 
-        case cv_type::LF_QUADWORD:
-            return *(int64_t*)&mem.name;
+    slot.store(&n, memory_order_release);
 
-        case cv_type::LF_UQUADWORD:
-            return *(uint64_t*)&mem.name;
+    return n;
+}
 
-        default:
-            throw formatted_error("Could not parse member offset type {}\n", (cv_type)mem.offset);
-    }
+void pdb::render_type_name(fmt::memory_buffer& out, uint32_t type) {
+    if (type_valid[type - h.type_index_begin])
+        render_type_name<false>(out, type);
+    else
+        render_type_name<true>(out, type);
 }
 
-string pdb::type_name(span<const uint8_t> t) {
-    if (t.size() < sizeof(cv_type))
+template<bool checked>
+void pdb::render_type_name(fmt::memory_buffer& out, uint32_t type) {
+    auto t = type_record(type - h.type_index_begin);
+
+    if (checked && t.size() < sizeof(cv_type))
         throw formatted_error("Truncated type");
 
-    auto kind = *(cv_type*)t.data();
+    auto kind = type_kinds[type - h.type_index_begin];
 
     switch (kind) {
         case cv_type::LF_POINTER: {
-            if (t.size() < sizeof(lf_pointer))
+            if (checked && t.size() < sizeof(lf_pointer))
                 throw formatted_error("Truncated LF_POINTER ({} bytes, expected {})", t.size(), sizeof(lf_pointer));
 
             const auto& p = *(lf_pointer*)t.data();
 
             if (p.base_type < h.type_index_begin)
-                return builtin_type(p.base_type) + "*";
-
-            if (p.base_type >= h.type_index_end)
-                throw formatted_error("Pointer base type {:x} was out of bounds.", p.base_type);
+                out.append(builtin_type(p.base_type));
+            else {
+                if (checked && p.base_type >= h.type_index_end)
+                    throw formatted_error("Pointer base type {:x} was out of bounds.", p.base_type);
 
-            const auto& bt = types[p.base_type - h.type_index_begin];
+                out.append(type_name(p.base_type));
+            }
 
-            return type_name(bt) + "*";
+            out.push_back('*');
+            break;
         }
 
         case cv_type::LF_STRUCTURE:
         case cv_type::LF_CLASS: {
-            if (t.size() < offsetof(lf_class, name))
+            if (checked && t.size() < offsetof(lf_class, name))
                 throw formatted_error("Truncated LF_STRUCTURE / LF_CLASS ({} bytes, expected at least {})", t.size(), offsetof(lf_class, name));
 
-            auto name = struct_name(t);
-
-            return string{name};
+            out.append(udt_name(type));
+            break;
         }
 
         case cv_type::LF_MODIFIER: {
-            if (t.size() < sizeof(lf_modifier))
+            if (checked && t.size() < sizeof(lf_modifier))
                 throw formatted_error("Truncated LF_MODIFIER ({} bytes, expected {})", t.size(), sizeof(lf_modifier));
 
             const auto& mod = *(lf_modifier*)t.data();
 
-            string pref;
-
             if (mod.mod_const)
-                pref = "const ";
+                out.append("const "sv);
 
             if (mod.mod_volatile)
-                pref += "volatile ";
+                out.append("volatile "sv);
 
             if (mod.base_type < h.type_index_begin)
-                return pref + builtin_type(mod.base_type);
-
-            if (mod.base_type >= h.type_index_end)
-                throw formatted_error("Modifier base type {:x} was out of bounds.", mod.base_type);
+                out.append(builtin_type(mod.base_type));
+            else {
+                if (checked && mod.base_type >= h.type_index_end)
+                    throw formatted_error("Modifier base type {:x} was out of bounds.", mod.base_type);
 
-            const auto& bt = types[mod.base_type - h.type_index_begin];
+                out.append(type_name(mod.base_type));
+            }
 
-            return pref + type_name(bt);
+            break;
         }
 
         case cv_type::LF_ENUM: {
-            if (t.size() < offsetof(lf_enum, name))
+            if (checked && t.size() < offsetof(lf_enum, name))
                 throw formatted_error("Truncated LF_ENUM ({} bytes, expected at least {})", t.size(), offsetof(lf_enum, name));
 
-            const auto& en = *(lf_enum*)t.data();
-
-            auto name = string_view(en.name, t.size() - offsetof(lf_enum, name));
-
-            if (auto st = name.find('\0'); st != string::npos)
-                name = name.substr(0, st);
-
-            return string{name};
+            out.append(udt_name(type));
+            break;
         }
 
         case cv_type::LF_UNION: {
-            if (t.size() < offsetof(lf_union, name))
+            if (checked && t.size() < offsetof(lf_union, name))
                 throw formatted_error("Truncated LF_UNION ({} bytes, expected at least {})", t.size(), offsetof(lf_union, name));
 
-            auto name = union_name(t);
-
-            return string{name};
+            out.append(udt_name(type));
+            break;
         }
 
         default:
@@ -530,13 +845,154 @@ string pdb::type_name(span<const uint8_t> t) {
     }
 }
 
-static size_t array_length(const lf_array& arr) {
-    // FIXME - long arrays
+static string_view unique_name(span<const uint8_t> t, string_view name) {
+    auto end = (const char*)t.data() + t.size();
+    auto start = name.data() + name.size() + 1;
 
-    return arr.length_in_bytes;
-}
+    if (start >= end)
+        return "";
 
-uint64_t pdb::get_type_size(uint32_t type) {
+    auto un = string_view(start, (size_t)(end - start));
+
+    if (auto st = un.find('\0'); st != string::npos)
+        un = un.substr(0, st);
+
+    return un;
+}
+
+// hashStringV1 in LLVM, Hash_LHash in the PDB sources
+static uint32_t hash_string_v1(string_view s) {
+    uint32_t ret = 0;
+    auto longs = span((const uint32_t*)s.data(), s.size() / sizeof(uint32_t));
+
+    for (auto l : longs) {
+        ret ^= l;
+    }
+
+    auto rem = span((const uint8_t*)s.data() + (longs.size() * sizeof(uint32_t)), s.size() % sizeof(uint32_t));
+
+    if (rem.size() >= sizeof(uint16_t)) {
+        ret ^= *(uint16_t*)rem.data();
+        rem = rem.subspan(sizeof(uint16_t));
+    }
+
+    if (!rem.empty())
+        ret ^= rem[0];
+
+    ret |= 0x20202020; // case-insensitive
+    ret ^= ret >> 11;
+
+    return ret ^ (ret >> 16);
+}
+
+// Called once build_type_info has found all the names, so that we don't have to parse
+// the candidates' records again.
+uint32_t pdb::find_definition(uint32_t type) {
+    auto t = type_record(type - h.type_index_begin);
+    auto kind = type_kinds[type - h.type_index_begin];
+    bool is_union = kind == cv_type::LF_UNION;
+    auto name = details[type - h.type_index_begin].name;
+    auto props = is_union ? ((lf_union*)t.data())->properties : ((lf_class*)t.data())->properties;
+    string_view uniq;
+
+    if (props & CV_PROP_HAS_UNIQUE_NAME)
+        uniq = unique_name(t, name);
+
+    auto is_match = [&](uint32_t type) {
+        const auto& ti2 = details[type - h.type_index_begin];
+
+        // has_name means the record's long enough to have properties
+        if (type_kinds[type - h.type_index_begin] != kind || !ti2.has_name)
+            return false;
+
+        auto t2 = type_record(type - h.type_index_begin);
+        auto props2 = is_union ? ((lf_union*)t2.data())->properties : ((lf_class*)t2.data())->properties;
+
+        if (props2 & CV_PROP_FORWARD_REF)
+            return false;
+
+        if (name != ti2.name)
+            return false;
+
+        if (!uniq.empty() && props2 & CV_PROP_HAS_UNIQUE_NAME)
+            return uniq == unique_name(t2, ti2.name);
+
+        return true;
+    };
+
+    if (!hash_bucket_offsets.empty()) {
+        // definitions are hashed by their unique name if scoped, and by their name otherwise
+        for (auto n : { name, uniq }) {
+            if (n.empty())
+                continue;
+
+            auto bucket = hash_string_v1(n) % h.num_hash_buckets;
+
+            for (auto i = hash_bucket_offsets[bucket]; i < hash_bucket_offsets[bucket + 1]; i++) {
+                if (is_match(hash_bucket_types[i]))
+                    return hash_bucket_types[i];
+            }
+        }
+    }
+
+    // no hash stream, or type not where it should have been - fall back to name index
+
+    if (!name_index_built)
+        build_name_index();
+
+    auto hash = hash_string_v1(name);
+    auto it = lower_bound(name_index.begin(), name_index.end(), hash, [](const typedb_name& n, uint32_t hash) {
+        return n.hash < hash;
+    });
+
+    for (; it != name_index.end() && it->hash == hash; it++) {
+        const auto& ti2 = details[it->type - h.type_index_begin];
+
+        if (type_kinds[it->type - h.type_index_begin] == kind && ti2.has_name && ti2.name == name)
+            return it->type;
+    }
+
+    return 0;
+}
+
+void pdb::build_name_index() {
+    name_index_buf.clear();
+
+    for (size_t i = 0; i < type_offsets.size(); i++) {
+        auto t = type_record(i);
+        auto kind = type_kinds[i];
+        auto cur_type = h.type_index_begin + (uint32_t)i;
+
+        // types with unparseable names get left out
+
+        try {
+            if ((kind == cv_type::LF_CLASS || kind == cv_type::LF_STRUCTURE) && t.size() >= offsetof(lf_class, name)) {
+                if (!(((lf_class*)t.data())->properties & CV_PROP_FORWARD_REF))
+                    name_index_buf.push_back({hash_string_v1(struct_name(t)), cur_type});
+            } else if (kind == cv_type::LF_UNION && t.size() >= offsetof(lf_union, name)) {
+                if (!(((lf_union*)t.data())->properties & CV_PROP_FORWARD_REF))
+                    name_index_buf.push_back({hash_string_v1(union_name(t)), cur_type});
+            }
+        } catch (...) {
+        }
+    }
+
+    // already in type order, so a stable sort keeps the first definition of a name first
+    stable_sort(name_index_buf.begin(), name_index_buf.end(), [](const typedb_name& a, const typedb_name& b) {
+        return a.hash < b.hash;
+    });
+
+    name_index = name_index_buf;
+    name_index_built = true;
+}
+
+static size_t array_length(const lf_array& arr) {
+    // FIXME - long arrays
+
+    return arr.length_in_bytes;
+}
+
+uint64_t pdb::get_type_size(uint32_t type) {
     if (type < h.type_index_begin) {
         if (type >> 8 == 4)
             return 4; // 32-bit pointer
@@ -586,14 +1042,33 @@ uint64_t pdb::get_type_size(uint32_t type) {
     if (type >= h.type_index_end)
         throw formatted_error("Type {:x} was out of bounds.", type);
 
-    const auto& t = types[type - h.type_index_begin];
+    const auto& ti = details[type - h.type_index_begin];
 
-    if (t.size() < sizeof(cv_type))
+    if (ti.has_size)
+        return ti.size;
+
+    return compute_type_size(type);
+}
+
+uint64_t pdb::compute_type_size(uint32_t type) {
+    if (type_valid[type - h.type_index_begin])
+        return compute_type_size<false>(type);
+
+    return compute_type_size<true>(type);
+}
+
+template<bool checked>
+uint64_t pdb::compute_type_size(uint32_t type) {
+    auto t = type_record(type - h.type_index_begin);
+
+    if (checked && t.size() < sizeof(cv_type))
         throw formatted_error("Type {:x} was truncated.", type);
 
-    switch (*(cv_type*)t.data()) {
+    auto kind = type_kinds[type - h.type_index_begin];
+
+    switch (kind) {
         case cv_type::LF_POINTER: {
-            if (t.size() < sizeof(lf_pointer))
+            if (checked && t.size() < sizeof(lf_pointer))
                 throw formatted_error("Pointer type {:x} was truncated.", type);
 
             const auto& ptr = *(lf_pointer*)t.data();
@@ -602,7 +1077,7 @@ uint64_t pdb::get_type_size(uint32_t type) {
         }
 
         case cv_type::LF_MODIFIER: {
-            if (t.size() < sizeof(lf_modifier))
+            if (checked && t.size() < sizeof(lf_modifier))
                 throw formatted_error("Modifier type {:x} was truncated.", type);
 
             const auto& mod = *(lf_modifier*)t.data();
@@ -611,7 +1086,7 @@ uint64_t pdb::get_type_size(uint32_t type) {
         }
 
         case cv_type::LF_ARRAY: {
-            if (t.size() < offsetof(lf_array, name))
+            if (checked && t.size() < offsetof(lf_array, name))
                 throw formatted_error("Array type {:x} was truncated.", type);
 
             return array_length(*(lf_array*)t.data());
@@ -619,45 +1094,25 @@ uint64_t pdb::get_type_size(uint32_t type) {
 
         case cv_type::LF_STRUCTURE:
         case cv_type::LF_CLASS: {
-            if (t.size() < offsetof(lf_class, name))
+            if (checked && t.size() < offsetof(lf_class, name))
                 throw formatted_error("Structure type {:x} was truncated.", type);
 
             const auto& str = *(lf_class*)t.data();
 
             if (str.properties & CV_PROP_FORWARD_REF) {
-                // resolve forward ref
-                auto name = struct_name(t);
-
-                // FIXME - use hash stream
-
-                for (const auto& t2 : types) {
-                    if (t2.size() < sizeof(cv_type) || *(cv_type*)t2.data() != *(cv_type*)t.data())
-                        continue;
-
-                    if (t2.size() < offsetof(lf_class, name))
-                        continue;
-
-                    const auto& str2 = *(lf_class*)t2.data();
-
-                    if (str2.properties & CV_PROP_FORWARD_REF)
-                        continue;
-
-                    auto name2 = struct_name(t2);
+                auto def = details[type - h.type_index_begin].definition;
 
-                    if (name == name2)
-                        return str2.length;
-                }
+                if (def == type)
+                    throw formatted_error("Could not resolve forward ref for struct {}.", udt_name(type));
 
-                throw formatted_error("Could not resolve forward ref for struct {}.", name);
+                return read_numeric<lf_class>(type_record(def - h.type_index_begin)).value;
             }
 
-            // FIXME - long structs
-
-            return str.length;
+            return read_numeric<lf_class>(t).value;
         }
 
         case cv_type::LF_ENUM: {
-            if (t.size() < offsetof(lf_enum, name))
+            if (checked && t.size() < offsetof(lf_enum, name))
                 throw formatted_error("Enum type {:x} was truncated.", type);
 
             const auto& en = *(lf_enum*)t.data();
@@ -666,124 +1121,74 @@ uint64_t pdb::get_type_size(uint32_t type) {
         }
 
         case cv_type::LF_UNION: {
-            if (t.size() < offsetof(lf_union, name))
+            if (checked && t.size() < offsetof(lf_union, name))
                 throw formatted_error("Union type {:x} was truncated.", type);
 
-            const auto* un = (lf_union*)t.data();
-
-            if (un->properties & CV_PROP_FORWARD_REF) {
-                // resolve forward ref
-
-                bool found = false;
-                auto name = union_name(t);
-
-                // FIXME - use hash stream
-
-                for (const auto& t2 : types) {
-                    if (t2.size() < sizeof(cv_type) || *(cv_type*)t2.data() != *(cv_type*)t.data())
-                        continue;
-
-                    if (t2.size() < offsetof(lf_union, name))
-                        continue;
-
-                    const auto& un2 = *(lf_union*)t2.data();
-
-                    if (un2.properties & CV_PROP_FORWARD_REF)
-                        continue;
+            const auto& un = *(lf_union*)t.data();
 
-                    auto name2 = union_name(t2);
+            if (un.properties & CV_PROP_FORWARD_REF) {
+                auto def = details[type - h.type_index_begin].definition;
 
-                    if (name == name2) {
-                        found = true;
-                        un = &un2;
-                        break;
-                    }
-                }
+                if (def == type)
+                    throw formatted_error("Could not resolve forward ref for union {}.", udt_name(type));
 
-                if (!found)
-                    throw formatted_error("Could not resolve forward ref for union {}.", name);
+                return read_numeric<lf_union>(type_record(def - h.type_index_begin)).value;
             }
 
-            if (un->length < 0x8000)
-                return un->length;
-
-            if (t.size() < offsetof(lf_union, name) + extended_value_len((cv_type)un->length))
-                throw formatted_error("Union type {:x} was truncated.", type);
-
-            switch ((cv_type)un->length) {
-                case cv_type::LF_CHAR:
-                    return *(int8_t*)&un->name;
-
-                case cv_type::LF_SHORT:
-                    return *(int16_t*)&un->name;
-
-                case cv_type::LF_USHORT:
-                    return *(uint16_t*)&un->name;
-
-                case cv_type::LF_LONG:
-                    return *(int32_t*)&un->name;
-
-                case cv_type::LF_ULONG:
-                    return *(uint32_t*)&un->name;
-
-                case cv_type::LF_QUADWORD:
-                    return *(int64_t*)&un->name;
-
-                case cv_type::LF_UQUADWORD:
-                    return *(uint64_t*)&un->name;
-
-                default:
-                    throw formatted_error("Could not parse union length type {}\n", (cv_type)un->length);
-            }
+            return read_numeric<lf_union>(t).value;
         }
 
         default:
-            throw formatted_error("Could not find size of {} type {:x}\n", *(cv_type*)t.data(), type);
+            throw formatted_error("Could not find size of {} type {:x}\n", kind, type);
     }
 }
 
-string pdb::arg_list_to_string(uint32_t arg_list) {
+void pdb::format_arg_list(fmt::memory_buffer& out, uint32_t arg_list) {
     if (arg_list < h.type_index_begin || arg_list >= h.type_index_end)
         throw formatted_error("Arg list type {:x} was out of bounds.", arg_list);
 
-    const auto& t = types[arg_list - h.type_index_begin];
+    if (type_valid[arg_list - h.type_index_begin])
+        format_arg_list<false>(out, arg_list);
+    else
+        format_arg_list<true>(out, arg_list);
+}
+
+template<bool checked>
+void pdb::format_arg_list(fmt::memory_buffer& out, uint32_t arg_list) {
+    auto t = type_record(arg_list - h.type_index_begin);
 
-    if (t.size() < sizeof(cv_type))
+    if (checked && t.size() < sizeof(cv_type))
         throw formatted_error("Arg list {:x} was truncated.", arg_list);
 
-    if (*(cv_type*)t.data() != cv_type::LF_ARGLIST)
-        throw formatted_error("LF_PROCEDURE pointed to {}, expected LF_ARGLIST.", *(cv_type*)t.data());
+    auto kind = type_kinds[arg_list - h.type_index_begin];
+
+    if (kind != cv_type::LF_ARGLIST)
+        throw formatted_error("LF_PROCEDURE pointed to {}, expected LF_ARGLIST.", kind);
 
-    if (t.size() < offsetof(lf_arglist, args))
+    if (checked && t.size() < offsetof(lf_arglist, args))
         throw formatted_error("Arg list {:x} was truncated.", arg_list);
 
     const auto& al = *(lf_arglist*)t.data();
 
-    if (t.size() < offsetof(lf_arglist, args) + (sizeof(uint32_t) * al.num_entries))
+    if (checked && t.size() < offsetof(lf_arglist, args) + (sizeof(uint32_t) * al.num_entries))
         throw formatted_error("Arg list {:x} was truncated.", arg_list);
 
-    string s;
-
     for (uint32_t i = 0; i < al.num_entries; i++) {
         if (i != 0)
-            s += ", ";
+            out.append(", "sv);
 
         auto n = al.args[i];
 
         if (n < h.type_index_begin) {
-            s += builtin_type(n);
+            out.append(builtin_type(n));
             continue;
         }
 
-        if (n >= h.type_index_end)
+        if (checked && n >= h.type_index_end)
             throw formatted_error("Argument type {:x} was out of bounds.", n);
 
-        const auto& t2 = types[n - h.type_index_begin];
-
-        s += format_member(t2, "" ,"");
+        format_member(out, n, "", "");
     }
-
-    return s;
 }
 
 static bool is_name_anonymous(string_view name) {
@@ -812,61 +1217,92 @@ static bool is_name_anonymous(string_view name) {
     return false;
 }
 
-string pdb::format_member(span<const uint8_t> mt, string_view name, string_view prefix) {
-    if (mt.size() >= sizeof(cv_type)) {
-        switch (*(cv_type*)mt.data()) {
+void pdb::format_member(fmt::memory_buffer& out, uint32_t type, string_view name, string_view prefix) {
+    if (type_valid[type - h.type_index_begin])
+        format_member<false>(out, type, name, prefix);
+    else
+        format_member<true>(out, type, name, prefix);
+}
+
+template<bool checked>
+void pdb::format_member(fmt::memory_buffer& out, uint32_t type, string_view name, string_view prefix) {
+    auto mt = type_record(type - h.type_index_begin);
+
+    if (!checked || mt.size() >= sizeof(cv_type)) {
+        switch (type_kinds[type - h.type_index_begin]) {
             case cv_type::LF_ARRAY: {
                 const auto* arr = (lf_array*)mt.data();
 
-                if (mt.size() < offsetof(lf_array, name))
+                if (checked && mt.size() < offsetof(lf_array, name))
                     throw formatted_error("Truncated LF_ARRAY ({} bytes, expected at least {})", mt.size(), offsetof(lf_array, name));
 
-                string name2{name};
-                size_t num_els = array_length(*arr) / get_type_size(arr->element_type);
+                // the element type's size can be 0 if it's malformed
+                auto count = [&](const lf_array& a) -> size_t {
+                    auto el_size = get_type_size(a.element_type);
+
+                    return el_size == 0 ? 0 : array_length(a) / el_size;
+                };
 
-                name2 += "[" + to_string(num_els) + "]";
+                fmt::memory_buffer name2;
+                size_t num_els = count(*arr);
+
+                fmt::format_to(back_inserter(name2), FMT_COMPILE("{}[{}]"), name, num_els);
+
+                // the inner arrays of a multidimensional one may not be valid, even if this one is
+                bool check_arr = checked;
 
                 do {
-                    if (arr->element_type < h.type_index_begin)
-                        return fmt::format("{} {}", builtin_type(arr->element_type), name2);
+                    if (arr->element_type < h.type_index_begin) {
+                        fmt::format_to(back_inserter(out), FMT_COMPILE("{} {}"), builtin_type(arr->element_type),
+                                       string_view(name2.data(), name2.size()));
+                        return;
+                    }
 
-                    if (arr->element_type >= h.type_index_end)
+                    if (check_arr && arr->element_type >= h.type_index_end)
                         throw formatted_error("Array element type {:x} was out of bounds.", arr->element_type);
 
-                    const auto& mt2 = types[arr->element_type - h.type_index_begin];
+                    if (type_kinds[arr->element_type - h.type_index_begin] != cv_type::LF_ARRAY) {
+                        format_member(out, arr->element_type, string_view(name2.data(), name2.size()), prefix);
+                        return;
+                    }
+
+                    auto mt2 = type_record(arr->element_type - h.type_index_begin);
+
+                    check_arr = !type_valid[arr->element_type - h.type_index_begin];
 
-                    if (mt2.size() < sizeof(cv_type) || *(cv_type*)mt2.data() != cv_type::LF_ARRAY)
-                        return format_member(mt2, name2, prefix);
+                    if (check_arr && mt2.size() < offsetof(lf_array, name))
+                        throw formatted_error("Truncated LF_ARRAY ({} bytes, expected at least {})", mt2.size(), offsetof(lf_array, name));
 
                     arr = (lf_array*)mt2.data();
 
-                    num_els = array_length(*arr) / get_type_size(arr->element_type);
+                    num_els = count(*arr);
 
-                    name2 += "[" + to_string(num_els) + "]";
+                    fmt::format_to(back_inserter(name2), FMT_COMPILE("[{}]"), num_els);
                 } while (true);
             }
 
             case cv_type::LF_BITFIELD: {
                 const auto& bf = *(lf_bitfield*)mt.data();
 
-                if (mt.size() < sizeof(lf_bitfield))
+                if (checked && mt.size() < sizeof(lf_bitfield))
                     throw formatted_error("Truncated LF_BITFIELD ({} bytes, expected {})", mt.size(), sizeof(lf_bitfield));
 
-                if (bf.base_type < h.type_index_begin)
-                    return fmt::format("{} {} : {}", builtin_type(bf.base_type), name, bf.length);
+                if (bf.base_type < h.type_index_begin) {
+                    fmt::format_to(back_inserter(out), FMT_COMPILE("{} {} : {}"), builtin_type(bf.base_type), name, bf.length);
+                    return;
+                }
 
-                if (bf.base_type >= h.type_index_end)
+                if (checked && bf.base_type >= h.type_index_end)
                     throw formatted_error("Bitfield base type {:x} was out of bounds.", bf.base_type);
 
-                const auto& mt2 = types[bf.base_type - h.type_index_begin];
-
-                return fmt::format("{} {} : {}", type_name(mt2), name, bf.length);
+                fmt::format_to(back_inserter(out), FMT_COMPILE("{} {} : {}"), type_name(bf.base_type), name, bf.length);
+                return;
             }
 
             case cv_type::LF_POINTER: {
                 // handle procedure pointers
 
-                if (mt.size() < sizeof(lf_pointer))
+                if (checked && mt.size() < sizeof(lf_pointer))
                     break;
 
                 const auto& ptr = *(lf_pointer*)mt.data();
@@ -874,43 +1310,43 @@ string pdb::format_member(span<const uint8_t> mt, string_view name, string_view
                 if (ptr.base_type < h.type_index_begin)
                     break;
 
-                if (ptr.base_type >= h.type_index_end)
+                if (checked && ptr.base_type >= h.type_index_end)
                     break;
 
-                const auto* mt2 = &types[ptr.base_type - h.type_index_begin];
+                auto mt2 = type_record(ptr.base_type - h.type_index_begin);
                 unsigned int depth = 1;
 
                 do {
-                    if (mt2->size() < sizeof(cv_type))
+                    if (mt2.size() < sizeof(cv_type))
                         break;
 
-                    if (*(cv_type*)mt2->data() == cv_type::LF_PROCEDURE) {
-                        if (mt2->size() < sizeof(lf_procedure))
-                            throw formatted_error("Truncated LF_PROCEDURE ({} bytes, expected {})", mt2->size(), sizeof(lf_procedure));
+                    if (*(cv_type*)mt2.data() == cv_type::LF_PROCEDURE) {
+                        if (mt2.size() < sizeof(lf_procedure))
+                            throw formatted_error("Truncated LF_PROCEDURE ({} bytes, expected {})", mt2.size(), sizeof(lf_procedure));
 
-                        const auto& proc = *(lf_procedure*)mt2->data();
-
-                        string ret;
+                        const auto& proc = *(lf_procedure*)mt2.data();
 
                         if (proc.return_type < h.type_index_begin)
-                            ret = builtin_type(proc.return_type);
+                            out.append(builtin_type(proc.return_type));
                         else {
                             if (proc.return_type >= h.type_index_end)
                                 throw formatted_error("Procedure return type {:x} was out of bounds.", proc.return_type);
 
-                            const auto& rt = types[proc.return_type - h.type_index_begin];
-
-                            ret = format_member(rt, "", prefix);
+                            format_member(out, proc.return_type, "", prefix);
                         }
 
-                        return fmt::format("{} ({:*>{}}{})({})", ret, "", depth, name, arg_list_to_string(proc.arglist));
-                    } else if (*(cv_type*)mt2->data() == cv_type::LF_POINTER) {
+                        fmt::format_to(back_inserter(out), " ({:*>{}}{})(", "", depth, name);
+                        format_arg_list(out, proc.arglist);
+                        out.push_back(')');
+
+                        return;
+                    } else if (*(cv_type*)mt2.data() == cv_type::LF_POINTER) {
                         depth++;
 
-                        if (mt2->size() < sizeof(lf_pointer))
+                        if (mt2.size() < sizeof(lf_pointer))
                             break;
 
-                        const auto& ptr = *(lf_pointer*)mt2->data();
+                        const auto& ptr = *(lf_pointer*)mt2.data();
 
                         if (ptr.base_type < h.type_index_begin)
                             break;
@@ -918,7 +1354,7 @@ string pdb::format_member(span<const uint8_t> mt, string_view name, string_view
                         if (ptr.base_type >= h.type_index_end)
                             break;
 
-                        mt2 = &types[ptr.base_type - h.type_index_begin];
+                        mt2 = type_record(ptr.base_type - h.type_index_begin);
                     } else
                         break;
                 } while (true);
@@ -927,112 +1363,84 @@ string pdb::format_member(span<const uint8_t> mt, string_view name, string_view
             }
 
             case cv_type::LF_UNION: {
-                if (mt.size() < offsetof(lf_union, name))
+                if (checked && mt.size() < offsetof(lf_union, name))
                     break;
 
                 const auto& un = *(lf_union*)mt.data();
 
-                if (!is_name_anonymous(union_name(mt)))
+                if (!is_anonymous(type))
                     break;
 
                 if (un.field_list < h.type_index_begin || un.field_list >= h.type_index_end)
                     break;
 
-                const auto& fl = types[un.field_list - h.type_index_begin];
-
-                auto s = fmt::format("union {{\n");
+                out.append("union {\n"sv);
 
                 string prefix2{prefix};
 
                 prefix2 += "    ";
 
-                walk_fieldlist(fl, [&](span<const uint8_t> d) {
-                    const auto& mem = *(lf_member*)d.data();
-
-                    if (mem.kind != cv_type::LF_MEMBER)
-                        return;
-
-                    size_t off = offsetof(lf_member, name);
-
-                    if (mem.offset >= 0x8000)
-                        off += extended_value_len((cv_type)mem.offset);
-
-                    auto name = string_view((char*)&mem + off, d.size() - off);
-
-                    if (auto st = name.find('\0'); st != string::npos)
-                        name = name.substr(0, st);
+                for (const auto& f : fields(un.field_list)) {
+                    if (f.kind != cv_type::LF_MEMBER)
+                        continue;
 
-                    if (mem.type < h.type_index_begin) {
-                        s += fmt::format("{}{} {};\n", prefix2, builtin_type(mem.type), name);
-                        return;
+                    if (f.type < h.type_index_begin) {
+                        fmt::format_to(back_inserter(out), FMT_COMPILE("{}{} {};\n"), prefix2, builtin_type(f.type), f.name);
+                        continue;
                     }
 
-                    if (mem.type >= h.type_index_end)
-                        throw formatted_error("Member type {:x} was out of bounds.", mem.type);
+                    if (f.type >= h.type_index_end)
+                        throw formatted_error("Member type {:x} was out of bounds.", f.type);
 
-                    const auto& mt = types[mem.type - h.type_index_begin];
-
-                    s += fmt::format("{}{};\n", prefix2, format_member(mt, name, prefix2));
-                });
+                    out.append(prefix2);
+                    format_member(out, f.type, f.name, prefix2);
+                    out.append(";\n"sv);
+                }
 
-                s += fmt::format("{}}} {}", prefix, name);
+                fmt::format_to(back_inserter(out), FMT_COMPILE("{}}} {}"), prefix, name);
 
-                return s;
+                return;
             }
 
             case cv_type::LF_STRUCTURE:
             case cv_type::LF_CLASS: {
-                if (mt.size() < offsetof(lf_class, name))
+                if (checked && mt.size() < offsetof(lf_class, name))
                     break;
 
                 const auto& str = *(lf_class*)mt.data();
 
-                if (!is_name_anonymous(struct_name(mt)))
+                if (!is_anonymous(type))
                     break;
 
                 if (str.field_list < h.type_index_begin || str.field_list >= h.type_index_end)
                     break;
 
-                const auto& fl = types[str.field_list - h.type_index_begin];
-
-                auto s = fmt::format("struct {{\n");
+                out.append("struct {\n"sv);
 
                 string prefix2{prefix};
 
                 prefix2 += "    ";
 
-                walk_fieldlist(fl, [&](span<const uint8_t> d) {
-                    const auto& mem = *(lf_member*)d.data();
-
-                    if (mem.kind != cv_type::LF_MEMBER)
-                        return;
-
-                    size_t off = offsetof(lf_member, name);
-
-                    if (mem.offset >= 0x8000)
-                        off += extended_value_len((cv_type)mem.offset);
-
-                    auto name = string_view((char*)&mem + off, d.size() - off);
-
-                    if (auto st = name.find('\0'); st != string::npos)
-                        name = name.substr(0, st);
+                for (const auto& f : fields(str.field_list)) {
+                    if (f.kind != cv_type::LF_MEMBER)
+                        continue;
 
-                    if (mem.type < h.type_index_begin) {
-                        s += fmt::format("{}{} {};\n", prefix2, builtin_type(mem.type), name);
-                        return;
+                    if (f.type < h.type_index_begin) {
+                        fmt::format_to(back_inserter(out), FMT_COMPILE("{}{} {};\n"), prefix2, builtin_type(f.type), f.name);
+                        continue;
                     }
 
-                    if (mem.type >= h.type_index_end)
-                        throw formatted_error("Member type {:x} was out of bounds.", mem.type);
+                    if (f.type >= h.type_index_end)
+                        throw formatted_error("Member type {:x} was out of bounds.", f.type);
 
-                    const auto& mt = types[mem.type - h.type_index_begin];
-
-                    s += fmt::format("{}{};\n", prefix2, format_member(mt, name, prefix2));
-                });
+                    out.append(prefix2);
+                    format_member(out, f.type, f.name, prefix2);
+                    out.append(";\n"sv);
+                }
 
-                s += fmt::format("{}}} {}", prefix, name);
+                fmt::format_to(back_inserter(out), FMT_COMPILE("{}}} {}"), prefix, name);
 
-                return s;
+                return;
             }
 
             default:
@@ -1041,87 +1449,90 @@ string pdb::format_member(span<const uint8_t> mt, string_view name, string_view
     }
 
     if (name.empty())
-        return type_name(mt);
+        out.append(type_name(type));
     else
-        return fmt::format("{} {}", type_name(mt), name);
+        fmt::format_to(back_inserter(out), FMT_COMPILE("{} {}"), type_name(type), name);
 }
 
-void pdb::add_asserts(const union_or_struct auto& d, string_view name, uint64_t off, vector<sa>& asserts) {
+void pdb::add_asserts(const union_or_struct auto& d, string_view name, uint64_t off, pmr::vector<sa>& asserts, arena& a) {
     if (d.field_list < h.type_index_begin || d.field_list >= h.type_index_end)
         throw formatted_error("Field list {:x} was out of bounds.", d.field_list);
 
-    const auto& fl = types[d.field_list - h.type_index_begin];
-
-    walk_fieldlist(fl, [&](span<const uint8_t> d) {
-        const auto& mem = *(lf_member*)d.data();
-
-        if (mem.kind != cv_type::LF_MEMBER)
-            return;
+    for (const auto& f : fields(d.field_list)) {
+        if (f.kind != cv_type::LF_MEMBER)
+            continue;
 
-        string mem_name{member_name(d)};
+        auto full_name = a.build([&](fmt::memory_buffer& buf) {
+            buf.append(name);
+            buf.push_back('.');
+            buf.append(f.name);
+        });
 
-        if (mem.type < h.type_index_begin) {
-            asserts.emplace_back(string{name} + "."s + mem_name, off + member_offset(d));
-            return;
+        if (f.type < h.type_index_begin) {
+            asserts.emplace_back(full_name, off + f.value);
+            continue;
         }
 
-        if (mem.type >= h.type_index_end)
-            throw formatted_error("Member type {:x} was out of bounds.", mem.type);
+        if (f.type >= h.type_index_end)
+            throw formatted_error("Member type {:x} was out of bounds.", f.type);
 
-        const auto& mt = types[mem.type - h.type_index_begin];
+        auto mt = type_record(f.type - h.type_index_begin);
 
         if (mt.size() >= sizeof(cv_type)) {
-            switch (*(cv_type*)mt.data()) {
+            switch (type_kinds[f.type - h.type_index_begin]) {
                 case cv_type::LF_BITFIELD:
-                    return;
+                    continue;
 
                 case cv_type::LF_STRUCTURE:
                 case cv_type::LF_CLASS: {
-                    if (!is_name_anonymous(struct_name(mt))) {
-                        asserts.emplace_back(string{name} + "."s + mem_name, off + member_offset(d));
+                    if (!is_anonymous(f.type)) {
+                        asserts.emplace_back(full_name, off + f.value);
                         break;
                     }
 
                     const auto& str = *(lf_class*)mt.data();
 
-                    add_asserts(str, string{name} + "."s + mem_name, off + member_offset(d), asserts);
+                    add_asserts(str, full_name, off + f.value, asserts, a);
 
                     break;
                 }
 
                 case cv_type::LF_UNION: {
-                    if (!is_name_anonymous(union_name(mt))) {
-                        asserts.emplace_back(string{name} + "."s + mem_name, off + member_offset(d));
-                        return;
+                    if (!is_anonymous(f.type)) {
+                        asserts.emplace_back(full_name, off + f.value);
+                        continue;
                     }
 
                     const auto& un = *(lf_union*)mt.data();
 
-                    add_asserts(un, string{name} + "."s + mem_name, off + member_offset(d), asserts);
+                    add_asserts(un, full_name, off + f.value, asserts, a);
 
                     break;
                 }
 
                 default:
-                    asserts.emplace_back(string{name} + "."s + mem_name, off + member_offset(d));
-                    return;
+                    asserts.emplace_back(full_name, off + f.value);
+                    continue;
             }
         }
-    });
+    }
 }
 
-void pdb::print_struct(span<const uint8_t> t) {
+void pdb::print_struct(uint32_t type, fmt::memory_buffer& out, arena& a) {
     struct memb {
         memb(string_view str, string_view name, uint64_t off, bool bitfield) :
             str(str), name(name), off(off), bitfield(bitfield) { }
 
-        string str;
-        string name;
+        string_view str;
+        string_view name;
         uint64_t off;
         bool bitfield;
     };
 
-    if (t.size() < offsetof(lf_class, name))
+    auto t = type_record(type - h.type_index_begin);
+    auto valid = type_valid[type - h.type_index_begin];
+
+    if (!valid && t.size() < offsetof(lf_class, name))
         throw formatted_error("Truncated LF_STRUCTURE / LF_CLASS ({} bytes, expected at least {})", t.size(), offsetof(lf_class, name));
 
     const auto& str = *(lf_class*)t.data();
@@ -1130,79 +1541,88 @@ void pdb::print_struct(span<const uint8_t> t) {
     if (str.properties & CV_PROP_FORWARD_REF)
         return;
 
-    if (is_name_anonymous(struct_name(t)))
+    if (is_anonymous(type))
         return;
 
-    if (str.field_list < h.type_index_begin || str.field_list >= h.type_index_end)
+    if (!valid && (str.field_list < h.type_index_begin || str.field_list >= h.type_index_end))
         throw formatted_error("Struct field list {:x} was out of bounds.", str.field_list);
 
-    // FIXME - derived_from
     // FIXME - vshape
 
-    const auto& fl = types[str.field_list - h.type_index_begin];
-
-    auto name = struct_name(t);
+    auto fl = fields(str.field_list);
+    auto name = udt_name(type);
 
-    vector<memb> members;
-    vector<sa> asserts;
+    pmr::vector<memb> members(&a);
+    pmr::vector<sa> asserts(&a);
 
     // FIXME - "class" instead if LF_CLASS
-    fmt::print("struct {} {{\n", name);
+    fmt::format_to(back_inserter(out), FMT_COMPILE("struct {}"), name);
 
-    walk_fieldlist(fl, [&](span<const uint8_t> d) {
-        const auto& mem = *(lf_member*)d.data();
+    bool first_base = true;
 
-        if (mem.kind != cv_type::LF_MEMBER)
-            return;
+    for (const auto& f : fl) {
+        if (f.kind != cv_type::LF_BCLASS && f.kind != cv_type::LF_VBCLASS)
+            continue;
 
-        auto name = member_name(d);
-        auto off = member_offset(d) * 8;
+        if (f.type < h.type_index_begin || f.type >= h.type_index_end)
+            throw formatted_error("Base class {:x} was out of bounds.", f.type);
 
-        if (mem.type < h.type_index_begin) {
-            members.emplace_back(fmt::format("    {} {};", builtin_type(mem.type), name), name, off, false);
+        fmt::format_to(back_inserter(out), FMT_COMPILE("{}{}{}"), first_base ? " : " : ", ",
+                       f.kind == cv_type::LF_VBCLASS ? "virtual " : "", type_name(f.type));
+        first_base = false;
+    }
+
+    fmt::format_to(back_inserter(out), FMT_COMPILE(" {{\n"));
+
+    for (const auto& f : fl) {
+        if (f.kind != cv_type::LF_MEMBER)
+            continue;
+
+        auto name = f.name;
+        auto off = f.value * 8;
+
+        if (f.type < h.type_index_begin) {
+            members.emplace_back(a.format(FMT_COMPILE("    {} {};"), builtin_type(f.type), name), name, off, false);
             asserts.emplace_back(name, off / 8);
-            return;
+            continue;
         }
 
-        if (mem.type >= h.type_index_end)
-            throw formatted_error("Member type {:x} was out of bounds.", mem.type);
+        if (f.type >= h.type_index_end)
+            throw formatted_error("Member type {:x} was out of bounds.", f.type);
 
-        const auto& mt = types[mem.type - h.type_index_begin];
+        auto mt = type_record(f.type - h.type_index_begin);
         bool bitfield = false;
 
         if (mt.size() >= sizeof(cv_type)) {
-            switch (*(cv_type*)mt.data()) {
-                case cv_type::LF_BITFIELD: {
-                    const auto& bf = *(lf_bitfield*)mt.data();
-
-                    off += bf.position;
+            switch (type_kinds[f.type - h.type_index_begin]) {
+                case cv_type::LF_BITFIELD:
+                    off += f.bit_position;
                     bitfield = true;
                     break;
-                }
 
                 case cv_type::LF_STRUCTURE:
                 case cv_type::LF_CLASS: {
-                    if (!is_name_anonymous(struct_name(mt))) {
+                    if (!is_anonymous(f.type)) {
                         asserts.emplace_back(name, off / 8);
                         break;
                     }
 
                     const auto& str = *(lf_class*)mt.data();
 
-                    add_asserts(str, name, off / 8, asserts);
+                    add_asserts(str, name, off / 8, asserts, a);
 
                     break;
                 }
 
                 case cv_type::LF_UNION: {
-                    if (!is_name_anonymous(union_name(mt))) {
+                    if (!is_anonymous(f.type)) {
                         asserts.emplace_back(name, off / 8);
                         break;
                     }
 
                     const auto& un = *(lf_union*)mt.data();
 
-                    add_asserts(un, name, off / 8, asserts);
+                    add_asserts(un, name, off / 8, asserts, a);
 
                     break;
                 }
@@ -1213,15 +1633,19 @@ void pdb::print_struct(span<const uint8_t> t) {
             }
         }
 
-        members.emplace_back(fmt::format("    {};", format_member(mt, name, "    ")), name, off, bitfield);
-    });
+        members.emplace_back(a.build([&](fmt::memory_buffer& buf) {
+            buf.append("    "sv);
+            format_member(buf, f.type, name, "    ");
+            buf.push_back(';');
+        }), name, off, bitfield);
+    }
 
     for (auto it = members.begin(); it != members.end(); it++) {
         if (next(it) != members.end() && next(it)->off == it->off) {
-            fmt::print("    union {{\n");
+            fmt::format_to(back_inserter(out), FMT_COMPILE("    union {{\n"));
 
             while (true) {
-                fmt::print("    {}\n", it->str);
+                fmt::format_to(back_inserter(out), FMT_COMPILE("    {}\n"), it->str);
 
                 if (next(it) != members.end() && next(it)->off == it->off)
                     it++;
@@ -1229,24 +1653,27 @@ void pdb::print_struct(span<const uint8_t> t) {
                     break;
             }
 
-            fmt::print("    }};\n");
+            fmt::format_to(back_inserter(out), FMT_COMPILE("    }};\n"));
         } else
-            fmt::print("{}\n", it->str);
+            fmt::format_to(back_inserter(out), FMT_COMPILE("{}\n"), it->str);
     }
 
-    fmt::print("}};\n\n");
+    fmt::format_to(back_inserter(out), FMT_COMPILE("}};\n\n"));
 
-    fmt::print("static_assert(sizeof({}) == 0x{:x});\n", name, struct_length(t));
+    fmt::format_to(back_inserter(out), FMT_COMPILE("static_assert(sizeof({}) == 0x{:x});\n"), name, get_type_size(type));
 
     for (const auto& a : asserts) {
-        fmt::print("static_assert(offsetof({}, {}) == 0x{:x});\n", name, a.name, a.off);
+        fmt::format_to(back_inserter(out), FMT_COMPILE("static_assert(offsetof({}, {}) == 0x{:x});\n"), name, a.name, a.off);
     }
 
-    fmt::print("\n");
+    fmt::format_to(back_inserter(out), FMT_COMPILE("\n"));
 }
 
-void pdb::print_union(span<const uint8_t> t) {
-    if (t.size() < offsetof(lf_union, name))
+void pdb::print_union(uint32_t type, fmt::memory_buffer& out, arena& a) {
+    auto t = type_record(type - h.type_index_begin);
+    auto valid = type_valid[type - h.type_index_begin];
+
+    if (!valid && t.size() < offsetof(lf_union, name))
         throw formatted_error("Truncated LF_UNION ({} bytes, expected at least {})", t.size(), offsetof(lf_union, name));
 
     const auto& un = *(lf_union*)t.data();
@@ -1255,59 +1682,51 @@ void pdb::print_union(span<const uint8_t> t) {
     if (un.properties & CV_PROP_FORWARD_REF)
         return;
 
-    if (is_name_anonymous(union_name(t)))
+    if (is_anonymous(type))
         return;
 
-    if (un.field_list < h.type_index_begin || un.field_list >= h.type_index_end)
+    if (!valid && (un.field_list < h.type_index_begin || un.field_list >= h.type_index_end))
         throw formatted_error("Union field list {:x} was out of bounds.", un.field_list);
 
     // FIXME - static_asserts (sizeof, offsetof)
 
-    const auto& fl = types[un.field_list - h.type_index_begin];
-
-    auto name = union_name(t);
-
-    vector<pair<string, uint64_t>> members;
+    auto fl = fields(un.field_list);
+    auto name = udt_name(type);
 
-    fmt::print("union {} {{\n", name);
+    pmr::vector<pair<string_view, uint64_t>> members(&a);
 
-    walk_fieldlist(fl, [&](span<const uint8_t> d) {
-        const auto& mem = *(lf_member*)d.data();
+    fmt::format_to(back_inserter(out), FMT_COMPILE("union {} {{\n"), name);
 
-        if (mem.kind != cv_type::LF_MEMBER)
-            return;
+    for (const auto& f : fl) {
+        if (f.kind != cv_type::LF_MEMBER)
+            continue;
 
-        auto name = member_name(d);
-        auto off = member_offset(d) * 8;
+        auto off = (f.value * 8) + f.bit_position;
 
-        if (mem.type < h.type_index_begin) {
-            members.emplace_back(fmt::format("    {} {};", builtin_type(mem.type), name), off);
-            return;
+        if (f.type < h.type_index_begin) {
+            members.emplace_back(a.format(FMT_COMPILE("    {} {};"), builtin_type(f.type), f.name), off);
+            continue;
         }
 
-        if (mem.type >= h.type_index_end)
-            throw formatted_error("Member type {:x} was out of bounds.", mem.type);
-
-        const auto& mt = types[mem.type - h.type_index_begin];
-
-        if (mt.size() >= sizeof(lf_bitfield) && *(cv_type*)mt.data() == cv_type::LF_BITFIELD) {
-            const auto& bf = *(lf_bitfield*)mt.data();
-
-            off += bf.position;
-        }
+        if (f.type >= h.type_index_end)
+            throw formatted_error("Member type {:x} was out of bounds.", f.type);
 
-        members.emplace_back(fmt::format("    {};", format_member(mt, name, "    ")), off);
-    });
+        members.emplace_back(a.build([&](fmt::memory_buffer& buf) {
+            buf.append("    "sv);
+            format_member(buf, f.type, f.name, "    ");
+            buf.push_back(';');
+        }), off);
+    }
 
     // FIXME - bitfields in implicit structs
     // FIXME - unions within implicit structs?
 
     for (auto it = members.begin(); it != members.end(); it++) {
         if (next(it) != members.end() && next(it)->second != 0) {
-            fmt::print("    struct {{\n");
+            fmt::format_to(back_inserter(out), FMT_COMPILE("    struct {{\n"));
 
             while (true) {
-                fmt::print("    {}\n", it->first);
+                fmt::format_to(back_inserter(out), FMT_COMPILE("    {}\n"), it->first);
 
                 if (next(it) != members.end() && next(it)->second != 0)
                     it++;
@@ -1315,390 +1734,2099 @@ void pdb::print_union(span<const uint8_t> t) {
                     break;
             }
 
-            fmt::print("    }};\n");
+            fmt::format_to(back_inserter(out), FMT_COMPILE("    }};\n"));
         } else
-            fmt::print("{}\n", it->first);
+            fmt::format_to(back_inserter(out), FMT_COMPILE("{}\n"), it->first);
     }
 
-    fmt::print("}};\n\n");
+    fmt::format_to(back_inserter(out), FMT_COMPILE("}};\n\n"));
 }
 
-void pdb::extract_types() {
-    if (bfd_seek(types_stream, 0, SEEK_SET))
-        throw formatted_error("bfd_seek failed ({})", bfd_errmsg(bfd_get_error()));
-
-    if (bfd_bread(&h, sizeof(h), types_stream) != sizeof(h))
-        throw formatted_error("bfd_bread failed ({})", bfd_errmsg(bfd_get_error()));
-
-    if (h.version != TPI_STREAM_VERSION_80)
-        throw formatted_error("Type stream version was {}, expected {}.", h.version, TPI_STREAM_VERSION_80);
-
-    if (bfd_seek(types_stream, h.header_size, SEEK_SET))
-        throw formatted_error("bfd_seek failed ({})", bfd_errmsg(bfd_get_error()));
-
-    type_records.resize(h.type_record_bytes);
+// The field lists that types point to are flattened into field_table, with their LF_INDEX
+// continuations spliced in. Each chain's lists are walked in lockstep, breaking off partway
+// through one to go into its continuation, so lists that no type reaches never get decoded.
+void pdb::build_field_table() {
+    auto num_types = type_offsets.size();
+    vector<uint8_t> used(num_types);
 
-    if (bfd_bread(type_records.data(), type_records.size(), types_stream) != type_records.size())
-        throw formatted_error("bfd_bread failed ({})", bfd_errmsg(bfd_get_error()));
+    auto use = [&](uint32_t field_list) {
+        if (field_list >= h.type_index_begin && field_list < h.type_index_end)
+            used[field_list - h.type_index_begin] = 1;
+    };
 
-    span sp(type_records);
+    for (size_t i = 0; i < num_types; i++) {
+        auto t = type_record(i);
 
-    types.reserve(h.type_index_end - h.type_index_begin);
+        switch (type_kinds[i]) {
+            case cv_type::LF_STRUCTURE:
+            case cv_type::LF_CLASS:
+                if (t.size() >= offsetof(lf_class, name))
+                    use(((lf_class*)t.data())->field_list);
+                break;
 
-    while (!sp.empty()) {
-        if (sp.size() < sizeof(uint16_t))
-            throw runtime_error("type_records was truncated");
+            case cv_type::LF_UNION:
+                if (t.size() >= offsetof(lf_union, name))
+                    use(((lf_union*)t.data())->field_list);
+                break;
 
-        auto len = *(uint16_t*)sp.data();
+            case cv_type::LF_ENUM:
+                if (t.size() >= offsetof(lf_enum, name))
+                    use(((lf_enum*)t.data())->field_list);
+                break;
 
-        sp = sp.subspan(sizeof(uint16_t));
+            default:
+                break;
+        }
+    }
 
-        if (sp.size() < len)
-            throw runtime_error("type_records was truncated");
+    // In a well-formed PDB every list is in exactly one chain, and every entry takes at least
+    // four bytes, so this is twice as many entries as there can be. Continuations shared between
+    // chains get walked once for each, so this limits that, and keeps the offsets within 32 bits.
+    auto max_entries = type_records.size() / 2;
+    size_t num_entries = 0;
 
-        types.emplace_back(sp.data(), len);
+    vector<uint8_t> in_chain(num_types);
+    vector<size_t> chain;
+    vector<fieldlist_range::iterator> stack;
 
-        sp = sp.subspan(len);
-    }
+    field_offsets.resize(num_types + 1);
 
-    uint32_t cur_type = h.type_index_begin;
+    for (size_t i = 0; i < num_types; i++) {
+        field_offsets[i] = (uint32_t)field_table.size();
 
-    for (const auto& t : types) {
-        if (t.size() < sizeof(cv_type))
+        if (!used[i] || type_kinds[i] != cv_type::LF_FIELDLIST)
             continue;
 
-        auto kind = *(cv_type*)t.data();
+        // errors get reported when something tries to use the field list
 
         try {
-            switch (kind) {
-                case cv_type::LF_ENUM:
-                    print_enum(t);
-                    break;
+            stack.push_back(fieldlist_range(type_record(i)).begin());
+            chain.push_back(i);
+            in_chain[i] = 1;
 
-                case cv_type::LF_UNION:
-                    print_union(t);
-                    break;
+            while (!stack.empty()) {
+                auto& it = stack.back();
 
-                case cv_type::LF_STRUCTURE:
-                case cv_type::LF_CLASS:
-                    print_struct(t);
-                    break;
+                if (it == default_sentinel) {
+                    stack.pop_back();
+                    continue;
+                }
 
-                default:
-                    break;
-            }
-        } catch (const exception& e) {
-            fmt::print(stderr, "Error parsing type {:x}: {}\n", cur_type, e.what());
-        }
+                auto f = *it;
 
-        cur_type++;
-    }
-}
+                ++it;
 
-static vector<uint8_t> read_image_rsds(bfd* b) {
-    IMAGE_DOS_HEADER dh;
-    IMAGE_NT_HEADERS pe;
+                if (++num_entries > max_entries)
+                    throw formatted_error("Field list {:x} has too many entries.", h.type_index_begin + i);
 
-    struct map_ctx {
-        const IMAGE_DATA_DIRECTORY* dd;
-        uint64_t base;
-        exception_ptr exc;
-        vector<uint8_t> dir;
-    };
+                if (f.kind == cv_type::LF_INDEX) {
+                    if (f.type < h.type_index_begin || f.type >= h.type_index_end)
+                        throw formatted_error("LF_INDEX type {:x} was out of bounds.", f.type);
 
-    if (bfd_seek(b, 0, SEEK_SET))
-        throw formatted_error("bfd_seek failed ({})", bfd_errmsg(bfd_get_error()));
+                    auto next = f.type - h.type_index_begin;
 
-    if (bfd_bread(&dh, sizeof(dh), b) != sizeof(dh))
-        throw formatted_error("bfd_bread failed ({})", bfd_errmsg(bfd_get_error()));
+                    if (in_chain[next])
+                        throw formatted_error("Field list {:x} was continued into more than once.", f.type);
 
-    if (dh.e_magic != IMAGE_DOS_SIGNATURE)
-        throw formatted_error("e_magic was {:04x}, expected {:04x}", dh.e_magic, IMAGE_DOS_SIGNATURE);
+                    stack.push_back(fieldlist_range(type_record(next)).begin());
+                    chain.push_back(next);
+                    in_chain[next] = 1;
+                    continue;
+                }
 
-    if (bfd_seek(b, dh.e_lfanew, SEEK_SET))
-        throw formatted_error("bfd_seek failed ({})", bfd_errmsg(bfd_get_error()));
+                if (f.kind == cv_type::LF_MEMBER && f.type >= h.type_index_begin && f.type < h.type_index_end &&
+                    type_kinds[f.type - h.type_index_begin] == cv_type::LF_BITFIELD) {
+                    auto mt = type_record(f.type - h.type_index_begin);
 
-    if (bfd_bread(&pe, sizeof(pe), b) != sizeof(pe))
-        throw formatted_error("bfd_bread failed ({})", bfd_errmsg(bfd_get_error()));
+                    if (mt.size() >= sizeof(lf_bitfield)) {
+                        const auto& bf = *(lf_bitfield*)mt.data();
 
-    if (pe.Signature != IMAGE_NT_SIGNATURE)
-        throw formatted_error("PE Signature was {:08x}, expected {:08x}", pe.Signature, IMAGE_NT_SIGNATURE);
+                        f.bit_position = bf.position;
+                        f.bit_length = bf.length;
+                    }
+                }
 
-    map_ctx ctx;
-    span<const IMAGE_DATA_DIRECTORY> dirs;
+                field_table.push_back(f);
+            }
+        } catch (...) {
+            stack.clear();
+            field_table.resize(field_offsets[i]);
+            field_errors.emplace(h.type_index_begin + (uint32_t)i, current_exception());
+        }
 
-    if (pe.OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
-        dirs = span(pe.OptionalHeader32.DataDirectory, pe.OptionalHeader32.NumberOfRvaAndSizes);
-        ctx.base = pe.OptionalHeader32.ImageBase;
-    } else if (pe.OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
-        dirs = span(pe.OptionalHeader64.DataDirectory, pe.OptionalHeader64.NumberOfRvaAndSizes);
-        ctx.base = pe.OptionalHeader64.ImageBase;
-    } else
-        throw formatted_error("PE Magic was {:04x}, expected {:04x} or {:04x}", pe.OptionalHeader32.Magic,
-                              IMAGE_NT_OPTIONAL_HDR32_MAGIC, IMAGE_NT_OPTIONAL_HDR64_MAGIC);
+        for (auto c : chain) {
+            in_chain[c] = 0;
+        }
 
-    if (dirs.size() <= IMAGE_DIRECTORY_ENTRY_DEBUG)
-        throw runtime_error("Image did not contain a IMAGE_DIRECTORY_ENTRY_DEBUG directory.");
+        chain.clear();
+    }
 
-    const auto& dd = dirs[IMAGE_DIRECTORY_ENTRY_DEBUG];
+    field_offsets[num_types] = (uint32_t)field_table.size();
+}
 
-    if (dd.Size == 0)
-        throw runtime_error("Image did not contain a IMAGE_DIRECTORY_ENTRY_DEBUG directory.");
+// This is empty for lists that no struct, union, or enum points to, as build_field_table skips them.
+span<const field> pdb::fields(uint32_t field_list) {
+    auto idx = field_list - h.type_index_begin;
+    auto t = type_record(idx);
 
-    ctx.dd = &dd;
+    if (t.size() < sizeof(cv_type))
+        throw formatted_error("Field list was truncated.");
 
-    bfd_map_over_sections(b, [](bfd* b, asection* sect, void* obj) {
-        auto& ctx = *(map_ctx*)obj;
+    if (type_kinds[idx] != cv_type::LF_FIELDLIST)
+        throw formatted_error("Type kind was {}, expected LF_FIELDLIST.", type_kinds[idx]);
+
+    if (auto it = field_errors.find(field_list); it != field_errors.end())
+        rethrow_exception(it->second);
+
+    return span(field_table).subspan(field_offsets[idx], field_offsets[idx + 1] - field_offsets[idx]);
+}
+
+void pdb::load_hash_stream() {
+    if (h.hash_stream_index == 0xffff)
+        return;
+
+    // MSVC never uses more than 0x40000 buckets
+    if (h.hash_key_size != sizeof(uint32_t) || h.num_hash_buckets == 0 || h.num_hash_buckets > 0x40000)
+        return;
+
+    auto num_types = h.type_index_end - h.type_index_begin;
+
+    if (type_offsets.size() != num_types || h.hash_value_buffer_length != num_types * sizeof(uint32_t))
+        return;
+
+    auto hs = hash_stream.data();
+
+    if (h.hash_value_buffer_offset > hs.size() || hs.size() - h.hash_value_buffer_offset < h.hash_value_buffer_length)
+        return;
+
+    auto hashes = span((const uint32_t*)(hs.data() + h.hash_value_buffer_offset), num_types);
+
+    // only definitions of structs and unions are ever looked up
+
+    auto is_definition = [&](size_t i) {
+        switch (type_kinds[i]) {
+            case cv_type::LF_CLASS:
+            case cv_type::LF_STRUCTURE: {
+                auto t = type_record(i);
+
+                return t.size() >= offsetof(lf_class, name) && !(((lf_class*)t.data())->properties & CV_PROP_FORWARD_REF);
+            }
+
+            case cv_type::LF_UNION: {
+                auto t = type_record(i);
+
+                return t.size() >= offsetof(lf_union, name) && !(((lf_union*)t.data())->properties & CV_PROP_FORWARD_REF);
+            }
+
+            default:
+                return false;
+        }
+    };
+
+    // counting sort into buckets, so that each bucket is in type order
+
+    vector<uint32_t> offsets;
+
+    offsets.resize(h.num_hash_buckets + 1);
+
+    for (size_t i = 0; i < type_offsets.size(); i++) {
+        if (hashes[i] >= h.num_hash_buckets)
+            return;
+
+        if (is_definition(i))
+            offsets[hashes[i] + 1]++;
+    }
+
+    for (size_t i = 1; i < offsets.size(); i++) {
+        offsets[i] += offsets[i - 1];
+    }
+
+    hash_bucket_types.resize(offsets.back());
+
+    auto pos = offsets;
+
+    for (size_t i = 0; i < type_offsets.size(); i++) {
+        if (is_definition(i))
+            hash_bucket_types[pos[hashes[i]]++] = h.type_index_begin + (uint32_t)i;
+    }
+
+    hash_bucket_offsets.swap(offsets);
+}
+
+// Throws if anything the printers read from the record for type h.type_index_begin + i
+// is truncated or out of bounds. Records that pass are marked in type_valid, and the printers
+// don't check them again.
+void pdb::check_type(size_t i) const {
+    auto t = type_record(i);
+    auto kind = type_kinds[i];
+
+    // builtin types are allowed here, but not for field and argument lists
+    auto check_ref = [&](uint32_t type, string_view what) {
+        if (type >= h.type_index_end)
+            throw formatted_error("{} {:x} was out of bounds.", what, type);
+    };
+
+    auto check_index = [&](uint32_t type, string_view what) {
+        if (type < h.type_index_begin || type >= h.type_index_end)
+            throw formatted_error("{} {:x} was out of bounds.", what, type);
+    };
+
+    auto check_size = [&](size_t size) {
+        if (t.size() < size)
+            throw formatted_error("Truncated {} ({} bytes, expected at least {})", kind, t.size(), size);
+    };
+
+    if (t.size() < sizeof(cv_type))
+        throw formatted_error("Truncated type");
+
+    switch (kind) {
+        case cv_type::LF_POINTER:
+            check_size(sizeof(lf_pointer));
+            check_ref(((lf_pointer*)t.data())->base_type, "Pointer base type");
+            break;
+
+        case cv_type::LF_MODIFIER:
+            check_size(sizeof(lf_modifier));
+            check_ref(((lf_modifier*)t.data())->base_type, "Modifier base type");
+            break;
+
+        case cv_type::LF_ARRAY:
+            check_size(offsetof(lf_array, name));
+            check_ref(((lf_array*)t.data())->element_type, "Array element type");
+            break;
+
+        case cv_type::LF_BITFIELD:
+            check_size(sizeof(lf_bitfield));
+            check_ref(((lf_bitfield*)t.data())->base_type, "Bitfield base type");
+            break;
+
+        case cv_type::LF_PROCEDURE: {
+            check_size(sizeof(lf_procedure));
+
+            const auto& proc = *(lf_procedure*)t.data();
+
+            check_ref(proc.return_type, "Procedure return type");
+            check_index(proc.arglist, "Arg list type");
+            break;
+        }
+
+        case cv_type::LF_ARGLIST: {
+            check_size(offsetof(lf_arglist, args));
+
+            const auto& al = *(lf_arglist*)t.data();
+
+            check_size(offsetof(lf_arglist, args) + (sizeof(uint32_t) * (size_t)al.num_entries));
+
+            for (uint32_t j = 0; j < al.num_entries; j++) {
+                check_ref(al.args[j], "Argument type");
+            }
+
+            break;
+        }
+
+        case cv_type::LF_STRUCTURE:
+        case cv_type::LF_CLASS: {
+            check_size(offsetof(lf_class, name));
+
+            const auto& str = *(lf_class*)t.data();
+            size_t off = numeric_leaf_at<lf_class>::offset + read_numeric<lf_class>(t).len;
+
+            read_name(t, off, kind);
+
+            if (!(str.properties & CV_PROP_FORWARD_REF))
+                check_index(str.field_list, "Struct field list");
+
+            break;
+        }
+
+        case cv_type::LF_UNION: {
+            check_size(offsetof(lf_union, name));
+
+            const auto& un = *(lf_union*)t.data();
+            size_t off = numeric_leaf_at<lf_union>::offset + read_numeric<lf_union>(t).len;
+
+            read_name(t, off, kind);
+
+            if (!(un.properties & CV_PROP_FORWARD_REF))
+                check_index(un.field_list, "Union field list");
+
+            break;
+        }
+
+        case cv_type::LF_ENUM: {
+            check_size(offsetof(lf_enum, name));
+
+            size_t off = offsetof(lf_enum, name);
+
+            read_name(t, off, kind);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+// This isn't saved in the type database, as we'd be trusting it not to have been corrupted.
+void pdb::validate_types() {
+    type_valid.assign(type_offsets.size(), 0);
+
+    for (size_t i = 0; i < type_offsets.size(); i++) {
+        try {
+            check_type(i);
+            type_valid[i] = 1;
+        } catch (...) {
+            // reported by report_invalid_types
+        }
+    }
+}
+
+void pdb::report_invalid_types(fmt::memory_buffer& err) const {
+    for (size_t i = 0; i < type_valid.size(); i++) {
+        if (type_valid[i])
+            continue;
+
+        try {
+            check_type(i);
+        } catch (const exception& e) {
+            fmt::format_to(back_inserter(err), "Malformed type {:x}: {}\n", h.type_index_begin + i, e.what());
+        }
+    }
+}
+
+void pdb::build_type_info() {
+    details.resize(type_offsets.size());
+    type_names = vector<atomic<const string*>>(type_offsets.size());
+
+    // names
+
+    for (size_t i = 0; i < type_offsets.size(); i++) {
+        auto t = type_record(i);
+        auto& ti = details[i];
+
+        ti.definition = h.type_index_begin + (uint32_t)i;
+
+        // errors get thrown again by the printers, when they look at the type themselves
+
+        try {
+            switch (type_kinds[i]) {
+                case cv_type::LF_STRUCTURE:
+                case cv_type::LF_CLASS: {
+                    if (t.size() < offsetof(lf_class, name))
+                        break;
+
+                    ti.name = struct_name(t);
+                    ti.has_name = true;
+                    ti.anonymous = is_name_anonymous(ti.name);
+                    break;
+                }
+
+                case cv_type::LF_UNION: {
+                    if (t.size() < offsetof(lf_union, name))
+                        break;
+
+                    ti.name = union_name(t);
+                    ti.has_name = true;
+                    ti.anonymous = is_name_anonymous(ti.name);
+                    break;
+                }
+
+                case cv_type::LF_ENUM: {
+                    if (t.size() < offsetof(lf_enum, name))
+                        break;
+
+                    auto name = string_view((char*)t.data() + offsetof(lf_enum, name), t.size() - offsetof(lf_enum, name));
+
+                    if (auto st = name.find('\0'); st != string::npos)
+                        name = name.substr(0, st);
+
+                    ti.name = name;
+                    ti.has_name = true;
+                    break;
+                }
+
+                default:
+                    break;
+            }
+        } catch (...) {
+        }
+    }
+
+    // resolve forward refs
+
+    for (size_t i = 0; i < type_offsets.size(); i++) {
+        auto& ti = details[i];
+
+        if (!ti.has_name || type_kinds[i] == cv_type::LF_ENUM)
+            continue;
+
+        auto t = type_record(i);
+        auto props = type_kinds[i] == cv_type::LF_UNION ? ((lf_union*)t.data())->properties : ((lf_class*)t.data())->properties;
+
+        if (props & CV_PROP_FORWARD_REF) {
+            if (auto def = find_definition(h.type_index_begin + (uint32_t)i); def != 0)
+                ti.definition = def;
+        }
+    }
+
+    // sizes - done in order, so that anything referred to has usually already been done
+
+    for (size_t i = 0; i < type_offsets.size(); i++) {
+        auto& ti = details[i];
+
+        switch (type_kinds[i]) {
+            case cv_type::LF_POINTER:
+            case cv_type::LF_MODIFIER:
+            case cv_type::LF_ARRAY:
+            case cv_type::LF_STRUCTURE:
+            case cv_type::LF_CLASS:
+            case cv_type::LF_ENUM:
+            case cv_type::LF_UNION:
+                try {
+                    ti.size = compute_type_size(h.type_index_begin + (uint32_t)i);
+                    ti.has_size = true;
+                } catch (...) {
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+string_view pdb::udt_name(uint32_t type) {
+    const auto& ti = details[type - h.type_index_begin];
+
+    if (ti.has_name)
+        return ti.name;
+
+    // will throw
+    if (type_kinds[type - h.type_index_begin] == cv_type::LF_UNION)
+        return union_name(type_record(type - h.type_index_begin));
+    else
+        return struct_name(type_record(type - h.type_index_begin));
+}
+
+bool pdb::is_anonymous(uint32_t type) {
+    const auto& ti = details[type - h.type_index_begin];
+
+    if (ti.has_name)
+        return ti.anonymous;
+
+    return is_name_anonymous(udt_name(type));
+}
+
+// records too short to have a kind get 0, which isn't a valid one
+static cv_type record_kind(span<const uint8_t> records, size_t off, uint16_t len) {
+    if (len < sizeof(cv_type))
+        return (cv_type)0;
+
+    return *(cv_type*)(records.data() + off + sizeof(uint16_t));
+}
+
+void pdb::scan_types() {
+    size_t off = 0;
+
+    // the header could be lying, but every record takes at least its length prefix
+    auto count = min((size_t)(h.type_index_end - h.type_index_begin), type_records.size() / sizeof(uint16_t));
+
+    type_offsets.clear();
+    type_offsets.reserve(count);
+    type_kinds.clear();
+    type_kinds.reserve(count);
+
+    while (off < type_records.size()) {
+        if (type_records.size() - off < sizeof(uint16_t))
+            throw runtime_error("type_records was truncated");
+
+        auto len = *(uint16_t*)(type_records.data() + off);
+
+        if (type_records.size() - off - sizeof(uint16_t) < len)
+            throw runtime_error("type_records was truncated");
+
+        type_offsets.push_back((uint32_t)off);
+        type_kinds.push_back(record_kind(type_records, off, len));
+
+        off += sizeof(uint16_t) + len;
+    }
+
+    if (type_offsets.size() != h.type_index_end - h.type_index_begin)
+        throw formatted_error("Type stream contained {} types, expected {}.", type_offsets.size(), h.type_index_end - h.type_index_begin);
+}
+
+// Below this, it's quicker to find the record boundaries on one thread.
+static constexpr size_t PARALLEL_SCAN_MIN = 1 << 20;
+
+// The index-offset buffer in the hash stream tells us where every so often type starts, so
+// we can split the records into pieces and find the boundaries in each piece independently.
+// Returns false if the buffer is missing or doesn't agree with the records, in which case
+// we fall back to scan_types.
+bool pdb::scan_types_parallel(unsigned int num_threads) {
+    auto hs = hash_stream.data();
+
+    if (h.index_offset_buffer_length == 0 || h.index_offset_buffer_length % sizeof(pdb_tpi_index_offset) != 0)
+        return false;
+
+    if (h.index_offset_buffer_offset > hs.size() || hs.size() - h.index_offset_buffer_offset < h.index_offset_buffer_length)
+        return false;
+
+    auto ios = span((const pdb_tpi_index_offset*)(hs.data() + h.index_offset_buffer_offset),
+                    h.index_offset_buffer_length / sizeof(pdb_tpi_index_offset));
+
+    // every record takes at least its length prefix, so a header claiming more types than
+    // that is lying, and we leave it to the serial scan rather than allocate for them all
+    if (h.type_index_end < h.type_index_begin || h.type_index_end - h.type_index_begin > type_records.size() / sizeof(uint16_t))
+        return false;
+
+    // a few pieces per thread, so that one with big records doesn't hold everybody up
+    auto piece_size = type_records.size() / (num_threads * 4);
+    vector<pdb_tpi_index_offset> splits;
+    pdb_tpi_index_offset prev{h.type_index_begin, 0};
+
+    splits.push_back(prev);
+
+    for (const auto& io : ios) {
+        if (io.type_index == prev.type_index && io.offset == prev.offset)
+            continue;
+
+        if (io.type_index <= prev.type_index || io.offset <= prev.offset)
+            return false;
+
+        if (io.type_index >= h.type_index_end || io.offset >= type_records.size())
+            return false;
+
+        if (io.offset - splits.back().offset >= piece_size)
+            splits.push_back(io);
+
+        prev = io;
+    }
+
+    if (splits.size() == 1)
+        return false;
+
+    splits.push_back({h.type_index_end, (uint32_t)type_records.size()});
+
+    type_offsets.resize(h.type_index_end - h.type_index_begin);
+    type_kinds.resize(h.type_index_end - h.type_index_begin);
+
+    atomic<size_t> next_piece = 0;
+    atomic<bool> ok = true;
+
+    auto worker = [&]() {
+        for (auto i = next_piece++; i < splits.size() - 1 && ok; i = next_piece++) {
+            size_t off = splits[i].offset;
+            auto end = splits[i + 1].offset;
+            auto ti = splits[i].type_index;
+
+            while (off < end) {
+                if (end - off < sizeof(uint16_t) || ti == splits[i + 1].type_index) {
+                    ok = false;
+                    return;
+                }
+
+                auto len = *(uint16_t*)(type_records.data() + off);
+
+                if (end - off - sizeof(uint16_t) < len) {
+                    ok = false;
+                    return;
+                }
+
+                type_offsets[ti - h.type_index_begin] = (uint32_t)off;
+                type_kinds[ti - h.type_index_begin] = record_kind(type_records, off, len);
+
+                off += sizeof(uint16_t) + len;
+                ti++;
+            }
+
+            // the buffer has to put the next piece exactly at a record boundary
+            if (ti != splits[i + 1].type_index) {
+                ok = false;
+                return;
+            }
+        }
+    };
+
+    {
+        vector<jthread> workers;
+
+        for (unsigned int i = 1; i < min(num_threads, (unsigned int)splits.size() - 1); i++) {
+            workers.emplace_back(worker);
+        }
+
+        worker();
+    }
+
+    return ok;
+}
+
+void pdb::extract_types(unsigned int num_threads) {
+    if (file.num_streams() <= PDB_STREAM_TPI)
+        throw runtime_error("Could not extract types stream 0002.");
+
+    tpi_stream = file.get_stream(PDB_STREAM_TPI);
+
+    auto tpi = tpi_stream.data();
+
+    if (tpi.size() < sizeof(h))
+        throw formatted_error("Type stream was {} bytes, expected at least {}.", tpi.size(), sizeof(h));
+
+    memcpy(&h, tpi.data(), sizeof(h));
+
+    if (h.version != TPI_STREAM_VERSION_80)
+        throw formatted_error("Type stream version was {}, expected {}.", h.version, TPI_STREAM_VERSION_80);
+
+    if (h.header_size > tpi.size() || tpi.size() - h.header_size < h.type_record_bytes)
+        throw formatted_error("Type stream was truncated ({} bytes, expected {}).", tpi.size(), (uint64_t)h.header_size + h.type_record_bytes);
+
+    type_records = tpi.subspan(h.header_size, h.type_record_bytes);
+
+    if (h.type_index_end < h.type_index_begin)
+        throw formatted_error("Type index end {:x} was before beginning {:x}.", h.type_index_end, h.type_index_begin);
+
+    if (!type_db_fn.empty() && load_type_db()) {
+        validate_types();
+        type_names = vector<atomic<const string*>>(type_offsets.size());
+        build_field_table();
+        return;
+    }
+
+    if (h.hash_stream_index != 0xffff && h.hash_stream_index < file.num_streams())
+        hash_stream = file.get_stream(h.hash_stream_index);
+
+    if (num_threads <= 1 || type_records.size() < PARALLEL_SCAN_MIN || !scan_types_parallel(num_threads))
+        scan_types();
+
+    load_hash_stream();
+    validate_types();
+    build_type_info();
+
+    if (!type_db_fn.empty()) {
+        try {
+            save_type_db();
+            type_db_written = true;
+        } catch (const exception& e) {
+            fmt::print(stderr, "Could not write type database {}: {}\n", type_db_fn.string(), e.what());
+        }
+    }
+
+    type_names = vector<atomic<const string*>>(type_offsets.size());
+    build_field_table();
+}
+
+optional<pdb_id> pdb::read_id() const {
+    if (file.num_streams() <= PDB_STREAM_DBI)
+        return nullopt;
+
+    auto info = file.get_stream(PDB_STREAM_INFO);
+    auto dbi = file.get_stream(PDB_STREAM_DBI);
+
+    if (info.data().size() < sizeof(pdb_info_stream_header) || dbi.data().size() < sizeof(pdb_dbi_stream_header))
+        return nullopt;
+
+    const auto& ih = *(pdb_info_stream_header*)info.data().data();
+    const auto& dh = *(pdb_dbi_stream_header*)dbi.data().data();
+    pdb_id id;
+
+    // the age in the info stream gets bumped on incremental links, the one in the DBI stream
+    // is what matches the RSDS record
+
+    memcpy(id.guid.data(), ih.guid, sizeof(ih.guid));
+    id.age = dh.age;
+
+    return id;
+}
+
+void pdb::set_type_db(const filesystem::path& fn, const pdb_id& id) {
+    type_db_fn = fn;
+    type_db_id = id;
+}
+
+static size_t typedb_align(size_t off) {
+    return (off + 7) & ~(size_t)7;
+}
+
+bool pdb::load_type_db() {
+    optional<mapped_file> f;
+
+    try {
+        f.emplace(type_db_fn);
+    } catch (...) {
+        return false;
+    }
+
+    auto d = f->data();
+
+    if (d.size() < sizeof(typedb_header))
+        return false;
+
+    const auto& th = *(typedb_header*)d.data();
+
+    // a mismatch here means the sidecar is stale, or was written by a different version - it'll
+    // get rebuilt
+
+    if (memcmp(th.magic, TYPEDB_MAGIC, sizeof(TYPEDB_MAGIC)) || th.version != TYPEDB_VERSION)
+        return false;
+
+    if (memcmp(th.guid, type_db_id.guid.data(), sizeof(th.guid)) || th.age != type_db_id.age)
+        return false;
+
+    if (th.tpi_stream_size != tpi_stream.data().size() || th.type_index_begin != h.type_index_begin ||
+        th.type_index_end != h.type_index_end) {
+        return false;
+    }
+
+    auto num_types = h.type_index_end - h.type_index_begin;
+    auto offsets_off = typedb_align(sizeof(typedb_header));
+    auto entries_off = typedb_align(offsets_off + ((num_types + 1) * sizeof(uint32_t)));
+    auto names_off = typedb_align(entries_off + (num_types * sizeof(typedb_entry)));
+
+    if (d.size() != names_off + (th.num_names * sizeof(typedb_name)))
+        return false;
+
+    auto offsets = span((const uint32_t*)(d.data() + offsets_off), num_types + 1);
+    auto entries = span((const typedb_entry*)(d.data() + entries_off), num_types);
+    auto names = span((const typedb_name*)(d.data() + names_off), th.num_names);
+
+    if (offsets[num_types] != type_records.size())
+        return false;
+
+    // Filled in locally and only swapped in once it's all checked out, so that if we give up
+    // halfway, the scan we fall back to doesn't start with half our entries.
+
+    vector<uint32_t> new_offsets(num_types);
+    vector<cv_type> new_kinds(num_types);
+    vector<type_details> new_details(num_types);
+
+    for (uint32_t i = 0; i < num_types; i++) {
+        const auto& e = entries[i];
+        auto& ti = new_details[i];
+
+        if (offsets[i + 1] < offsets[i] + sizeof(uint16_t) || offsets[i + 1] > type_records.size())
+            return false;
+
+        // the length of the record has to agree, as that's what we go by
+        if (*(uint16_t*)(type_records.data() + offsets[i]) != offsets[i + 1] - offsets[i] - sizeof(uint16_t))
+            return false;
+
+        // check_type goes by the kind, so it has to be the record's own
+        if (e.kind != record_kind(type_records, offsets[i], (uint16_t)(offsets[i + 1] - offsets[i] - sizeof(uint16_t))))
+            return false;
+
+        if ((uint64_t)e.name_offset + e.name_length > type_records.size())
+            return false;
+
+        if (e.definition < h.type_index_begin || e.definition >= h.type_index_end)
+            return false;
+
+        new_offsets[i] = offsets[i];
+        new_kinds[i] = e.kind;
+
+        ti.has_name = e.flags & TYPEDB_HAS_NAME;
+        ti.anonymous = e.flags & TYPEDB_ANONYMOUS;
+        ti.has_size = e.flags & TYPEDB_HAS_SIZE;
+        ti.definition = e.definition;
+        ti.size = e.size;
+        ti.name = string_view((const char*)type_records.data() + e.name_offset, e.name_length);
+    }
+
+    for (const auto& n : names) {
+        if (n.type < h.type_index_begin || n.type >= h.type_index_end)
+            return false;
+    }
+
+    type_offsets.swap(new_offsets);
+    type_kinds.swap(new_kinds);
+    details.swap(new_details);
+    name_index = names;
+    name_index_built = true;
+    type_db = move(f);
+
+    return true;
+}
+
+void pdb::save_type_db() {
+    if (!name_index_built)
+        build_name_index();
+
+    auto num_types = (uint32_t)type_offsets.size();
+    auto offsets_off = typedb_align(sizeof(typedb_header));
+    auto entries_off = typedb_align(offsets_off + ((num_types + 1) * sizeof(uint32_t)));
+    auto names_off = typedb_align(entries_off + (num_types * sizeof(typedb_entry)));
+    vector<uint8_t> buf;
+
+    buf.resize(names_off + (name_index.size() * sizeof(typedb_name)));
+
+    auto& th = *(typedb_header*)buf.data();
+
+    memcpy(th.magic, TYPEDB_MAGIC, sizeof(TYPEDB_MAGIC));
+    th.version = TYPEDB_VERSION;
+    th.age = type_db_id.age;
+    memcpy(th.guid, type_db_id.guid.data(), sizeof(th.guid));
+    th.tpi_stream_size = (uint32_t)tpi_stream.data().size();
+    th.type_index_begin = h.type_index_begin;
+    th.type_index_end = h.type_index_end;
+    th.num_names = (uint32_t)name_index.size();
+
+    auto offsets = (uint32_t*)(buf.data() + offsets_off);
+    auto entries = (typedb_entry*)(buf.data() + entries_off);
+
+    for (uint32_t i = 0; i < num_types; i++) {
+        const auto& ti = details[i];
+        auto& e = entries[i];
+
+        offsets[i] = type_offsets[i];
+
+        e.kind = type_kinds[i];
+        e.flags = (uint8_t)((ti.has_name ? TYPEDB_HAS_NAME : 0) | (ti.anonymous ? TYPEDB_ANONYMOUS : 0) |
+                            (ti.has_size ? TYPEDB_HAS_SIZE : 0));
+        e.definition = ti.definition;
+        e.size = ti.size;
+
+        if (!ti.name.empty()) {
+            e.name_offset = (uint32_t)((const uint8_t*)ti.name.data() - type_records.data());
+            e.name_length = (uint32_t)ti.name.size();
+        }
+    }
+
+    offsets[num_types] = (uint32_t)type_records.size();
+
+    memcpy(buf.data() + names_off, name_index.data(), name_index.size() * sizeof(typedb_name));
+
+    // write to a temporary file and rename it, so nobody ever sees a partial sidecar
+
+    filesystem::create_directories(type_db_fn.parent_path());
+
+    auto tmp_fn = type_db_fn;
+
+    static atomic<unsigned int> tmp_counter = 0;
+
+    // in batch mode, two inputs can share a PDB, so the PID isn't enough to be unique
+    tmp_fn += fmt::format(".{}.{}.tmp", getpid(), tmp_counter++);
+
+    {
+        ofstream f(tmp_fn, ios::binary);
+
+        if (!f.good())
+            throw formatted_error("Could not open {} for writing.", tmp_fn.string());
+
+        f.write((char*)buf.data(), (streamsize)buf.size());
+
+        if (!f.good()) {
+            f.close();
+            filesystem::remove(tmp_fn);
+            throw formatted_error("Error writing {}.", tmp_fn.string());
+        }
+    }
+
+    filesystem::rename(tmp_fn, type_db_fn);
+}
+
+void pdb::print_types(uint32_t first, uint32_t last, fmt::memory_buffer& out, fmt::memory_buffer& err) {
+    arena a;
+
+    for (uint32_t cur_type = first; cur_type < last; cur_type++) {
+        a.reset();
+
+        // already reported by report_invalid_types
+        if (!type_valid[cur_type - h.type_index_begin])
+            continue;
+
+        try {
+            switch (type_kinds[cur_type - h.type_index_begin]) {
+                case cv_type::LF_ENUM:
+                    print_enum(cur_type, out);
+                    break;
+
+                case cv_type::LF_UNION:
+                    print_union(cur_type, out, a);
+                    break;
+
+                case cv_type::LF_STRUCTURE:
+                case cv_type::LF_CLASS:
+                    print_struct(cur_type, out, a);
+                    break;
+
+                default:
+                    break;
+            }
+        } catch (const exception& e) {
+            fmt::format_to(back_inserter(err), "Error parsing type {:x}: {}\n", cur_type, e.what());
+        }
+    }
+}
+
+static void write_buffer(FILE* f, const fmt::memory_buffer& buf) {
+    if (fwrite(buf.data(), 1, buf.size(), f) != buf.size())
+        throw formatted_error("Error writing output ({}).", strerror(errno));
+}
+
+static constexpr uint32_t TYPES_PER_CHUNK = 1024;
+
+uint32_t pdb::num_chunks() const {
+    return (h.type_index_end - h.type_index_begin + TYPES_PER_CHUNK - 1) / TYPES_PER_CHUNK;
+}
+
+pair<uint32_t, uint32_t> pdb::chunk_range(uint32_t i) const {
+    auto first = h.type_index_begin + (i * TYPES_PER_CHUNK);
+
+    return make_pair(first, min(first + TYPES_PER_CHUNK, h.type_index_end));
+}
+
+void pdb::print_all_types(output_sink& out, unsigned int num_threads) {
+    struct chunk {
+        fmt::memory_buffer out;
+        fmt::memory_buffer err;
+        exception_ptr exc;
+        bool done = false;
+    };
+
+    auto num_chunks = this->num_chunks();
+
+    {
+        fmt::memory_buffer err;
+
+        report_invalid_types(err);
+        write_buffer(stderr, err);
+    }
+
+    if (num_threads <= 1 || num_chunks <= 1) {
+        for (uint32_t i = 0; i < num_chunks; i++) {
+            chunk c;
+            auto [first, last] = chunk_range(i);
+
+            print_types(first, last, c.out, c.err);
+            out.write(move(c.out));
+            write_buffer(stderr, c.err);
+        }
+
+        out.flush();
+
+        return;
+    }
+
+    // Each worker renders a chunk of types into its own buffers, and we write them out in
+    // order as they're finished, so the output is the same as if we'd done it serially.
+    // Workers don't get more than a few chunks ahead of the writer, to bound our memory use.
+
+    vector<chunk> chunks(num_chunks);
+    mutex mut;
+    condition_variable cv;
+    uint32_t next_chunk = 0, written = 0;
+    auto window = num_threads * 4;
+
+    auto worker = [&]() {
+        while (true) {
+            uint32_t i;
+
+            {
+                unique_lock lock(mut);
+
+                cv.wait(lock, [&]() { return next_chunk >= num_chunks || next_chunk < written + window; });
+
+                if (next_chunk >= num_chunks)
+                    return;
+
+                i = next_chunk++;
+            }
+
+            try {
+                auto [first, last] = chunk_range(i);
+
+                print_types(first, last, chunks[i].out, chunks[i].err);
+            } catch (...) {
+                chunks[i].exc = current_exception();
+            }
+
+            {
+                lock_guard lock(mut);
+
+                chunks[i].done = true;
+            }
+
+            cv.notify_all();
+        }
+    };
+
+    vector<jthread> workers;
+
+    workers.reserve(num_threads);
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        workers.emplace_back(worker);
+    }
+
+    auto stop = [&]() {
+        {
+            lock_guard lock(mut);
+
+            next_chunk = num_chunks;
+        }
+
+        cv.notify_all();
+    };
+
+    try {
+        for (uint32_t i = 0; i < num_chunks; i++) {
+            {
+                unique_lock lock(mut);
+
+                cv.wait(lock, [&]() { return chunks[i].done; });
+            }
+
+            if (chunks[i].exc)
+                rethrow_exception(chunks[i].exc);
+
+            out.write(move(chunks[i].out));
+            write_buffer(stderr, chunks[i].err);
+
+            chunks[i].err = fmt::memory_buffer();
+
+            {
+                lock_guard lock(mut);
+
+                written++;
+            }
+
+            cv.notify_all();
+        }
+    } catch (...) {
+        stop();
+        throw;
+    }
+
+    out.flush();
+}
+
+static filesystem::path xdg_cache_dir() {
+    if (auto s = getenv("XDG_CACHE_HOME"))
+        return s;
+
+    auto s = getenv("HOME");
+
+    if (!s)
+        throw runtime_error("HOME environment variable not set.");
+
+    auto p = filesystem::path{s};
+
+    p /= ".cache";
+
+    return p;
+}
+
+static string pdb_hexstr(span<const uint8_t, 16> sig, uint32_t age) {
+    return fmt::format("{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:X}",
+                       sig[3], sig[2], sig[1], sig[0], sig[5], sig[4], sig[7], sig[6],
+                       sig[8], sig[9], sig[10], sig[11], sig[12], sig[13], sig[14], sig[15], age);
+}
+
+static symbol_path get_symbol_path(const options& opts) {
+    auto default_store = xdg_cache_dir() / "pdb";
+
+    if (!opts.sym_path.empty())
+        return symbol_path(opts.sym_path, default_store);
+
+    if (auto s = getenv("_NT_SYMBOL_PATH"); s && *s)
+        return symbol_path(s, default_store);
+
+    return symbol_path(fmt::format("srv*{}*https://msdl.microsoft.com/download/symbols", default_store.string()), default_store);
+}
+
+static unique_ptr<pdb_cache> cache;
+static once_flag cache_once;
+
+static pdb_cache& get_cache(const options& opts) {
+    call_once(cache_once, [&]() {
+        cache = make_unique<pdb_cache>(xdg_cache_dir() / "pdb", opts.cache_size);
+    });
+
+    return *cache;
+}
+
+static void stored_pdb(const symbol_location& loc, const options& opts) {
+    auto& c = get_cache(opts);
+
+    write_back_pdb(loc);
+
+    c.add(loc.fn);
+
+    for (const auto& fn : loc.write_back) {
+        c.add(fn);
+    }
+}
+
+static filesystem::path found_pdb(const symbol_location& loc, const options& opts) {
+    fmt::print(stderr, "Using cached file at {}\n", loc.fn.string());
+
+    stored_pdb(loc, opts);
+
+    return loc.fn;
+}
+
+static filesystem::path cab_fn(const symbol_location& loc) {
+    auto fn = loc.fn;
+    auto name = fn.filename().string();
+
+    name.back() = '_';
+    fn.replace_filename(name);
+
+    return fn;
+}
+
+// Servers that have given us cabinets we could unpack. We only try the compressed version first
+// from these: otherwise LZX cabinets, which we can't unpack, would get downloaded as well as the
+// PDB, and servers without cabinets would cost an extra request each time. The list is kept in
+// the store, so that later runs know too.
+static mutex cab_mut;
+static unordered_set<string> cab_servers; // protected by cab_mut
+static unordered_set<string> cab_stores; // ones we've read the list from, protected by cab_mut
+
+static filesystem::path cab_list_fn(const symbol_location& loc) {
+    return loc.store / "pdbdump-cab.txt";
+}
+
+// called with cab_mut held
+static void load_cab_list(const symbol_location& loc) {
+    if (!cab_stores.insert(loc.store.string()).second)
+        return;
+
+    ifstream f(cab_list_fn(loc));
+    string line;
+
+    while (getline(f, line)) {
+        if (!line.empty())
+            cab_servers.insert(line);
+    }
+}
+
+static bool cab_first(const symbol_location& loc) {
+    if (loc.cab_url.empty())
+        return false;
+
+    lock_guard lg(cab_mut);
+
+    load_cab_list(loc);
+
+    return cab_servers.contains(loc.server);
+}
+
+static void set_cab_server(const symbol_location& loc, bool cabs) {
+    lock_guard lg(cab_mut);
+
+    load_cab_list(loc);
+
+    if (cabs ? !cab_servers.insert(loc.server).second : cab_servers.erase(loc.server) == 0)
+        return;
+
+    // write to a temporary file first, so nobody sees it half-written
+
+    auto fn = cab_list_fn(loc);
+    auto tmp_fn = fn;
+
+    tmp_fn += fmt::format(".{}.tmp", getpid());
+
+    {
+        ofstream f(tmp_fn, ios::trunc);
+
+        for (const auto& server : cab_servers) {
+            f << server << '\n';
+        }
+
+        if (!f)
+            return;
+    }
+
+    error_code ec;
+
+    filesystem::rename(tmp_fn, fn, ec);
+}
+
+static void unpack_cab(const symbol_location& loc) {
+    auto fn = cab_fn(loc);
+
+    try {
+        extract_cab(fn, loc.fn);
+    } catch (const unsupported_cab_error&) {
+        error_code ec;
+
+        filesystem::remove(fn, ec);
+        set_cab_server(loc, false);
+        throw;
+    } catch (...) {
+        error_code ec;
+
+        filesystem::remove(fn, ec);
+        throw;
+    }
+
+    filesystem::remove(fn);
+    set_cab_server(loc, true);
+}
+
+static void download_cab(const symbol_location& loc) {
+    fmt::print(stderr, "Trying to download from {}\n", loc.cab_url);
+
+    download_manager::get().download(loc.cab_url, cab_fn(loc));
+    unpack_cab(loc);
+}
+
+static void download_pdb(const symbol_location& loc) {
+    // If the server has given us cabinets before, try the compressed version first, as it's a lot
+    // smaller. Otherwise, we only try it if there's no uncompressed version.
+
+    auto first = cab_first(loc);
+
+    if (first) {
+        try {
+            download_cab(loc);
 
-        if (ctx.exc || !ctx.dir.empty())
             return;
+        } catch (const exception& e) {
+            fmt::print(stderr, "Could not download {}: {}\n", loc.cab_url, e.what());
+        }
+    }
+
+    try {
+        fmt::print(stderr, "Trying to download from {}\n", loc.url);
+
+        download_manager::get().download(loc.url, loc.fn);
+    } catch (...) {
+        if (first || loc.cab_url.empty())
+            throw;
+
+        // if the cabinet isn't there either, the error for the PDB is the one to report
+
+        auto e = current_exception();
 
         try {
-            if (sect->vma > ctx.base + ctx.dd->VirtualAddress)
-                return;
+            download_cab(loc);
+        } catch (const exception& ex) {
+            fmt::print(stderr, "Could not download {}: {}\n", loc.cab_url, ex.what());
+            rethrow_exception(e);
+        }
+    }
+}
 
-            if (sect->vma + sect->size <= ctx.base + ctx.dd->VirtualAddress)
-                return;
+// Makes sure only one process at a time fetches into a location. This returns with the lock
+// held, so if the PDB is there now, somebody else has fetched it for us.
+static file_lock lock_fill(const filesystem::path& fn) {
+    auto lock_fn = fn;
+
+    lock_fn += ".lock";
+
+    file_lock l(lock_fn);
 
-            ctx.dir.resize(ctx.dd->Size);
+    if (!l.try_lock(true)) {
+        fmt::print(stderr, "Waiting for another process to fetch {}\n", fn.string());
+        l.lock(true);
+    }
 
-            bfd_byte* data = nullptr;
+    return l;
+}
 
-            if (!bfd_get_full_section_contents(b, sect, &data))
-                throw formatted_error("bfd_get_full_section_contents failed ({})", bfd_errmsg(bfd_get_error()));
+static filesystem::path load_pdb(const vector<symbol_location>& locs, const options& opts) {
+    exception_ptr last_error;
 
-            memcpy(ctx.dir.data(), data + ctx.dd->VirtualAddress + ctx.base - sect->vma, ctx.dd->Size);
+    for (const auto& loc : locs) {
+        if (loc.url.empty()) {
+            if (get_cache(opts).contains(loc.fn))
+                return found_pdb(loc, opts);
 
-            free(data);
-        } catch (...) {
-            ctx.exc = current_exception();
+            continue;
         }
-    }, &ctx);
 
-    if (ctx.exc)
-        rethrow_exception(ctx.exc);
+        try {
+            filesystem::create_directories(loc.fn.parent_path());
+
+            auto fill = lock_fill(loc.fn);
+
+            if (filesystem::exists(loc.fn))
+                return found_pdb(loc, opts);
+
+            if (opts.partial_fetch) {
+                fmt::print(stderr, "Fetching type streams from {}\n", loc.url);
 
-    span<const IMAGE_DEBUG_DIRECTORY> dbginfo;
-    const IMAGE_DEBUG_DIRECTORY* cvinfo = nullptr;
+                auto ret = fetch_pdb_streams(loc.url, loc.fn);
 
-    dbginfo = span((IMAGE_DEBUG_DIRECTORY*)ctx.dir.data(), ctx.dir.size() / sizeof(IMAGE_DEBUG_DIRECTORY));
+                fmt::print(stderr, "Saved to {}\n", ret.string());
 
-    for (const auto& d : dbginfo) {
-        if (d.Type != IMAGE_DEBUG_TYPE_CODEVIEW)
+                // only copy it elsewhere once we've got all of it
+                if (ret == loc.fn)
+                    stored_pdb(loc, opts);
+
+                return ret;
+            }
+
+            download_pdb(loc);
+        } catch (const exception& e) {
+            fmt::print(stderr, "Could not download {}: {}\n", loc.url, e.what());
+            last_error = current_exception();
             continue;
+        }
+
+        fmt::print(stderr, "Saved to {}\n", loc.fn.string());
 
-        cvinfo = &d;
-        break;
+        stored_pdb(loc, opts);
+
+        return loc.fn;
     }
 
-    if (!cvinfo)
-        throw runtime_error("Image does not contain CodeView debug information.");
+    if (last_error)
+        rethrow_exception(last_error);
+
+    throw runtime_error("PDB not found in symbol path.");
+}
+
+static vector<symbol_location> pdb_locations_for_image(span<const uint8_t> image, const options& opts) {
+    auto vec = read_image_rsds(image);
 
-    if (bfd_seek(b, cvinfo->PointerToRawData, SEEK_SET))
-        throw formatted_error("bfd_seek failed ({})", bfd_errmsg(bfd_get_error()));
+    if (vec.size() < offsetof(CV_INFO_PDB70, PdbFileName))
+        throw formatted_error("CV debug info was {} bytes, expected at least {}.", vec.size(), offsetof(CV_INFO_PDB70, PdbFileName));
 
-    vector<uint8_t> rsds;
+    const auto& rsds = *(CV_INFO_PDB70*)vec.data();
 
-    rsds.resize(cvinfo->SizeOfData);
+    if (rsds.CvSignature != CVINFO_PDB70_CVSIGNATURE)
+        throw formatted_error("CV signature was {:x}, expected {:x}.", rsds.CvSignature, CVINFO_PDB70_CVSIGNATURE);
 
-    if (bfd_bread(rsds.data(), rsds.size(), b) != rsds.size())
-        throw formatted_error("bfd_bread failed ({})", bfd_errmsg(bfd_get_error()));
+    auto name = string_view(rsds.PdbFileName, vec.size() - offsetof(CV_INFO_PDB70, PdbFileName));
+
+    if (auto st = name.find('\0'); st != string::npos)
+        name = name.substr(0, st);
 
-    return rsds;
+    return get_symbol_path(opts).locations(name, pdb_hexstr(rsds.Signature, rsds.Age));
 }
 
-static filesystem::path xdg_cache_dir() {
-    if (auto s = getenv("XDG_CACHE_HOME"))
-        return s;
+namespace {
+struct pdb_file {
+    pdb_file(mapped_file&& f, file_lock&& lock) : lock(move(lock)), m(move(f)), p(m) { }
 
-    auto s = getenv("HOME");
+    file_lock lock; // stops the cache evicting it while we're using it
+    msf m;
+    pdb p;
+};
+}
 
-    if (!s)
-        throw runtime_error("HOME environment variable not set.");
+// If cache_lock is set, fn is a PDB that we've found in the symbol path, and it's the lock on it.
+static unique_ptr<pdb_file> open_pdb(const string& fn, const options& opts, optional<file_lock> cache_lock = nullopt) {
+    filesystem::path pdb_fn = fn;
+    bool in_cache = cache_lock.has_value();
+    file_lock lock;
 
-    auto p = filesystem::path{s};
+    if (cache_lock)
+        lock = move(*cache_lock);
 
-    p /= ".cache";
+    mapped_file f(fn);
 
-    return p;
+    if (!msf::is_msf(f.data())) {
+        auto locs = pdb_locations_for_image(f.data(), opts);
+
+        pdb_fn = load_pdb(locs, opts);
+
+        auto l = get_cache(opts).lock_entry(pdb_fn);
+
+        // If it was evicted before we got the lock, it's been dropped from the cache's index,
+        // so looking again will go on to the next location.
+        if (!l) {
+            fmt::print(stderr, "{} was removed from the cache, looking again\n", pdb_fn.string());
+
+            pdb_fn = load_pdb(locs, opts);
+            l = get_cache(opts).lock_entry(pdb_fn);
+
+            if (!l)
+                throw formatted_error("{} was removed from the cache.", pdb_fn.string());
+        }
+
+        lock = move(*l);
+        f = mapped_file(pdb_fn);
+        in_cache = true;
+    }
+
+    auto pf = make_unique<pdb_file>(move(f), move(lock));
+    auto& p = pf->p;
+
+    if (opts.use_type_db) {
+        if (auto id = p.read_id()) {
+            // The type database lives next to the PDB, but only if that's in a symbol store, so
+            // that it goes wherever the PDB does, and gets evicted from the cache along with it.
+
+            auto name = pdb_fn.extension() == ".partial" ? pdb_fn.stem() : pdb_fn.filename();
+            auto dir = pdb_fn.parent_path();
+
+            if (dir.filename() == pdb_hexstr(id->guid, id->age) && dir.parent_path().filename() == name) {
+                auto db_fn = dir / name;
+
+                db_fn += ".typedb";
+
+                p.set_type_db(db_fn, *id);
+            }
+        }
+    }
+
+    // in batch mode, we're already running on every thread
+    p.extract_types(opts.batch ? 1 : opts.num_threads);
+
+    // the type database counts towards the size of the cache entry
+    if (in_cache && p.wrote_type_db())
+        get_cache(opts).add(pdb_fn);
+
+    return pf;
+}
+
+static void load_file(const string& fn, const options& opts) {
+    auto pf = open_pdb(fn, opts);
+    auto& p = pf->p;
+
+    if (opts.output_fn.empty()) {
+        output_sink out(STDOUT_FILENO);
+
+        p.print_all_types(out, opts.num_threads);
+    } else {
+        output_sink out(opts.output_fn);
+
+        p.print_all_types(out, opts.num_threads);
+    }
+}
+
+namespace {
+// Locations being fetched by our batch jobs, and the jobs waiting for them. Other processes are
+// kept out by lock_fill, but if our own jobs blocked in that, they would tie up pool workers that
+// the job holding the lock may need to finish. So they're parked here instead, off the pool.
+class fill_registry {
+public:
+    // If somebody else has fn, waiter gets called when they release it.
+    bool acquire(const string& fn, function<void()> waiter) {
+        lock_guard lock(mut);
+
+        auto [it, inserted] = fills.try_emplace(fn);
+
+        if (inserted)
+            return true;
+
+        it->second.push_back(move(waiter));
+
+        return false;
+    }
+
+    void release(const string& fn) {
+        vector<function<void()>> waiters;
+
+        {
+            lock_guard lock(mut);
+
+            auto it = fills.find(fn);
+
+            waiters = move(it->second);
+            fills.erase(it);
+        }
+
+        for (auto& w : waiters) {
+            w();
+        }
+    }
+
+private:
+    mutex mut;
+    unordered_map<string, vector<function<void()>>> fills;
+};
+
+fill_registry batch_fills;
+
+// Held by a batch job while it's fetching into a location.
+class batch_fill {
+public:
+    batch_fill(const filesystem::path& fn) : fn(fn.string()) { }
+
+    ~batch_fill() {
+        batch_fills.release(fn);
+    }
+
+    string fn;
+    file_lock lock;
+};
+
+struct batch_job {
+    struct chunk {
+        fmt::memory_buffer out;
+        fmt::memory_buffer err;
+        bool done = false;
+    };
+
+    string input;
+    filesystem::path pdb_fn; // input, or the PDB we found for it
+    vector<symbol_location> locations;
+    exception_ptr last_error;
+    shared_ptr<batch_fill> fill;
+    filesystem::path output_fn;
+    shared_ptr<pdb_file> pf;
+    optional<output_sink> out;
+    vector<chunk> chunks;
+    bool render = true; // false if we only want the PDB
+    bool fetched = false; // true if we had to download the PDB
+    bool relocated = false; // true if the PDB we found was evicted, and we had to look again
+    uint32_t next_write = 0; // protected by mut
+    bool failed = false; // protected by mut
+    mutex mut;
+};
 }
 
-static size_t curl_write_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
-    auto& h = *(ofstream*)userdata;
+static void write_prefixed(FILE* f, string_view prefix, const fmt::memory_buffer& buf) {
+    auto sv = string_view(buf.data(), buf.size());
 
-    h.write(ptr, size * nmemb);
+    while (!sv.empty()) {
+        auto nl = sv.find('\n');
+        auto line = sv.substr(0, nl == string_view::npos ? sv.size() : nl + 1);
 
-    return size * nmemb;
+        fmt::print(f, "{}: {}", prefix, line);
+
+        sv = sv.substr(line.size());
+    }
+}
+
+static void batch_failed(batch_job& job, const exception& e) {
+    fmt::print(stderr, "{}: {}\n", job.input, e.what());
+
+    job.failed = true;
+    job.fill.reset();
+    job.chunks.clear();
+    job.out.reset();
+    job.pf.reset();
 }
 
-static void download_file(const string& url, const filesystem::path& dest) {
-    CURL* curl;
-    CURLcode res;
+// Called with job.mut held, once chunk i has been rendered. Writes out whatever's now
+// contiguous, and releases everything for the file once it's all been written.
+static void batch_chunk_done(batch_job& job, uint32_t i) {
+    job.chunks[i].done = true;
+
+    while (job.next_write < job.chunks.size() && job.chunks[job.next_write].done) {
+        auto& c = job.chunks[job.next_write];
+
+        job.out->write(move(c.out));
+        write_prefixed(stderr, job.input, c.err);
+
+        c.err = fmt::memory_buffer();
+        job.next_write++;
+    }
+
+    if (job.next_write == job.chunks.size()) {
+        job.out->flush();
+        job.out.reset();
+        job.chunks.clear();
+        job.pf.reset();
+    }
+}
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+static void batch_locate(work_pool& pool, const shared_ptr<batch_job>& job, const options& opts, size_t i);
 
+static void batch_render(work_pool& pool, const shared_ptr<batch_job>& job, const options& opts) {
     try {
-        curl = curl_easy_init();
+        optional<file_lock> lock;
 
-        if (!curl)
-            throw runtime_error("Failed to initialize cURL.");
+        if (!job->locations.empty()) {
+            lock = get_cache(opts).lock_entry(job->pdb_fn);
 
-        try {
-            long error_code;
+            // Evicted since we found it, so look again, which skips it now that the cache has forgotten it.
+            if (!lock) {
+                if (job->relocated)
+                    throw formatted_error("{} was removed from the cache.", job->pdb_fn.string());
+
+                fmt::print(stderr, "{} was removed from the cache, looking again\n", job->pdb_fn.string());
+
+                job->relocated = true;
+                batch_locate(pool, job, opts, 0);
+                return;
+            }
+        }
+
+        job->pf = open_pdb(job->pdb_fn.string(), opts, move(lock));
+        job->out.emplace(job->output_fn);
+
+        fmt::memory_buffer err;
+
+        job->pf->p.report_invalid_types(err);
+        write_prefixed(stderr, job->input, err);
+
+        auto num_chunks = job->pf->p.num_chunks();
+
+        if (num_chunks == 0) {
+            job->out->flush();
+            job->out.reset();
+            job->pf.reset();
+            return;
+        }
+
+        job->chunks.resize(num_chunks);
+    } catch (const exception& e) {
+        batch_failed(*job, e);
+        return;
+    }
+
+    // The chunks go on this worker's own queue, so it carries on with this file while
+    // idle workers steal chunks from it, or start on the next file.
+
+    for (uint32_t i = 0; i < job->chunks.size(); i++) {
+        pool.submit([job, i]() {
+            fmt::memory_buffer out, err;
+            shared_ptr<pdb_file> pf;
 
             {
-                ofstream h(dest, ios::binary);
+                lock_guard lock(job->mut);
+
+                if (job->failed)
+                    return;
+
+                pf = job->pf;
+            }
 
-                if (!h.good())
-                    throw formatted_error("Could not open {} for writing.", dest.string());
+            auto [first, last] = pf->p.chunk_range(i);
 
-                h.exceptions(ofstream::failbit | ofstream::badbit);
+            pf->p.print_types(first, last, out, err);
 
-                curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-                curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-                curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, ""); // everything that libcurl supports
+            lock_guard lock(job->mut);
 
-                curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-                curl_easy_setopt(curl, CURLOPT_WRITEDATA, &h);
+            if (job->failed)
+                return;
 
-                res = curl_easy_perform(curl);
+            try {
+                job->chunks[i].out = move(out);
+                job->chunks[i].err = move(err);
 
-                if (res != CURLE_OK)
-                    throw runtime_error(curl_easy_strerror(res));
+                batch_chunk_done(*job, i);
+            } catch (const exception& e) {
+                batch_failed(*job, e);
             }
+        });
+    }
+}
 
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &error_code); // FIXME - only do if HTTP or HTTPS?
+static void batch_download(work_pool& pool, const shared_ptr<batch_job>& job, const options& opts, size_t i, bool cab, bool last);
 
-            if (error_code >= 400)
-                throw formatted_error("HTTP error {}", error_code);
-        } catch (...) {
-            curl_easy_cleanup(curl);
-            throw;
-        }
+// Tries the other version of location i's PDB if there is one to try, otherwise moves on to the next location.
+static void batch_download_failed(work_pool& pool, const shared_ptr<batch_job>& job, const options& opts, size_t i, bool cab, bool last,
+                                  exception_ptr e) {
+    // if the cabinet isn't there either, the error for the PDB is the one to report
+    if (!cab)
+        job->last_error = e;
 
-        curl_easy_cleanup(curl);
-    } catch (...) {
-        curl_global_cleanup();
-        throw;
+    if (!last) {
+        batch_download(pool, job, opts, i, !cab, true);
+        return;
     }
 
-    curl_global_cleanup();
+    job->fill.reset();
+
+    batch_locate(pool, job, opts, i + 1);
+}
+
+// Downloads location i's PDB, or its compressed version if cab is set. Unless last is set, the other
+// one gets tried if this fails.
+static void batch_download(work_pool& pool, const shared_ptr<batch_job>& job, const options& opts, size_t i, bool cab, bool last) {
+    const auto& loc = job->locations[i];
+    const auto& url = cab ? loc.cab_url : loc.url;
+
+    fmt::print(stderr, "Trying to download from {}\n", url);
+
+    pool.hold();
+
+    download_manager::get().start(url, cab ? cab_fn(loc) : loc.fn, [&pool, job, &opts, i, cab, last](exception_ptr e) {
+        if (e) {
+            try {
+                rethrow_exception(e);
+            } catch (const exception& ex) {
+                const auto& loc = job->locations[i];
+
+                fmt::print(stderr, "Could not download {}: {}\n", cab ? loc.cab_url : loc.url, ex.what());
+            }
+
+            pool.submit([&pool, job, &opts, i, cab, last, e]() {
+                try {
+                    batch_download_failed(pool, job, opts, i, cab, last, e);
+                } catch (const exception& ex) {
+                    batch_failed(*job, ex);
+                }
+            });
+        } else {
+            pool.submit([&pool, job, &opts, i, cab, last]() {
+                const auto& loc = job->locations[i];
+
+                try {
+                    if (cab) {
+                        try {
+                            unpack_cab(loc);
+                        } catch (const exception& ex) {
+                            fmt::print(stderr, "Could not extract {}: {}\n", cab_fn(loc).string(), ex.what());
+                            batch_download_failed(pool, job, opts, i, cab, last, current_exception());
+                            return;
+                        }
+                    }
+
+                    fmt::print(stderr, "Saved to {}\n", loc.fn.string());
+                    stored_pdb(loc, opts);
+                    job->fill.reset();
+
+                    job->pdb_fn = loc.fn;
+                    job->fetched = true;
+                } catch (const exception& ex) {
+                    batch_failed(*job, ex);
+                    return;
+                }
+
+                if (job->render)
+                    batch_render(pool, job, opts);
+            });
+        }
+
+        pool.release();
+    });
 }
 
-static bfdup load_pdb(span<const uint8_t, 16> sig, uint32_t age, string_view name) {
-    auto hexstr = fmt::format("{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}{:X}",
-                              sig[3], sig[2], sig[1], sig[0], sig[5], sig[4], sig[7], sig[6],
-                              sig[8], sig[9], sig[10], sig[11], sig[12], sig[13], sig[14], sig[15], age);
+// Works through the symbol path from location i onwards. If we need to download the PDB,
+// we kick that off and carry on when it's done, rather than tying up a worker while it happens.
+static void batch_locate(work_pool& pool, const shared_ptr<batch_job>& job, const options& opts, size_t i) {
+    try {
+        for (; i < job->locations.size(); i++) {
+            const auto& loc = job->locations[i];
+
+            if (loc.url.empty()) {
+                if (!get_cache(opts).contains(loc.fn))
+                    continue;
+
+                job->pdb_fn = found_pdb(loc, opts);
+                break;
+            }
+
+            filesystem::create_directories(loc.fn.parent_path());
+
+            // If another of our jobs is already fetching this, wait for it to finish, then try again.
+
+            pool.hold();
+
+            if (!batch_fills.acquire(loc.fn.string(), [&pool, job, &opts, i]() {
+                pool.submit([&pool, job, &opts, i]() {
+                    batch_locate(pool, job, opts, i);
+                });
+
+                pool.release();
+            })) {
+                return;
+            }
+
+            pool.release();
+
+            job->fill = make_shared<batch_fill>(loc.fn);
+            job->fill->lock = lock_fill(loc.fn);
 
-    auto cache_dir = xdg_cache_dir() / "pdb";
+            if (filesystem::exists(loc.fn)) {
+                job->fill.reset();
+                job->pdb_fn = found_pdb(loc, opts);
+                break;
+            }
+
+            batch_download(pool, job, opts, i, cab_first(loc), loc.cab_url.empty());
+
+            return;
+        }
+
+        if (i == job->locations.size()) {
+            if (job->last_error)
+                rethrow_exception(job->last_error);
+
+            throw runtime_error("PDB not found in symbol path.");
+        }
+    } catch (const exception& e) {
+        batch_failed(*job, e);
+        return;
+    }
+
+    if (job->render)
+        batch_render(pool, job, opts);
+}
+
+static void batch_open(work_pool& pool, const shared_ptr<batch_job>& job, const options& opts) {
+    try {
+        mapped_file f(job->input);
 
-    if (!filesystem::exists(cache_dir)) {
-        if (!filesystem::create_directory(cache_dir))
-            throw formatted_error("Failed to create directory {}.", cache_dir.string());
+        // partial fetches aren't done asynchronously, so get left to open_pdb
+        if (!msf::is_msf(f.data()) && !opts.partial_fetch)
+            job->locations = pdb_locations_for_image(f.data(), opts);
+    } catch (const exception& e) {
+        batch_failed(*job, e);
+        return;
     }
 
-    auto fn = cache_dir / name / hexstr / name;
+    if (job->locations.empty())
+        batch_render(pool, job, opts);
+    else
+        batch_locate(pool, job, opts, 0);
+}
 
-    if (filesystem::exists(fn)) {
-        fmt::print(stderr, "Using cached file at {}\n", fn.string());
+static vector<string> read_list_file(const filesystem::path& fn) {
+    ifstream f(fn);
+    vector<string> ret;
+    string line;
 
-        auto pdb = bfd_openr(fn.string().c_str(), nullptr);
+    if (!f.good())
+        throw formatted_error("Could not open {}.", fn.string());
 
-        if (!pdb)
-            throw formatted_error("Could not load PDB file {} ({}).", fn.string(), bfd_errmsg(bfd_get_error()));
+    while (getline(f, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
 
-        return bfdup{pdb};
+        if (!line.empty())
+            ret.push_back(line);
     }
 
-    filesystem::create_directories(cache_dir / name / hexstr);
+    return ret;
+}
 
-    auto url = fmt::format("https://msdl.microsoft.com/download/symbols/{}/{}/{}",
-                           name, hexstr, name);
+static bool run_batch(const vector<string>& inputs, const options& opts) {
+    auto out_dir = opts.output_fn.empty() ? filesystem::path{"."} : opts.output_fn;
+    vector<shared_ptr<batch_job>> jobs;
+    unordered_map<string, unsigned int> names;
 
-    fmt::print(stderr, "Trying to download from {}\n", url);
+    filesystem::create_directories(out_dir);
+
+    for (const auto& in : inputs) {
+        auto job = make_shared<batch_job>();
+        auto name = filesystem::path{in}.filename().string();
+
+        // don't let two inputs with the same filename overwrite each other's output
+        if (auto n = names[name]++; n != 0)
+            name = fmt::format("{}.{}", name, n);
 
-    download_file(url, fn);
+        job->input = in;
+        job->pdb_fn = in;
+        job->output_fn = out_dir / (name + ".h");
 
-    fmt::print(stderr, "Saved to {}\n", fn.string());
+        jobs.push_back(move(job));
+    }
+
+    work_pool pool(opts.num_threads);
+
+    for (const auto& job : jobs) {
+        pool.submit([&pool, job, &opts]() {
+            batch_open(pool, job, opts);
+        });
+    }
 
-    auto pdb = bfd_openr(fn.string().c_str(), nullptr);
+    pool.wait();
 
-    if (!pdb)
-        throw formatted_error("Could not load PDB file {} ({}).", fn.string(), bfd_errmsg(bfd_get_error()));
+    return none_of(jobs.begin(), jobs.end(), [](const auto& job) { return job->failed; });
+}
 
-    return bfdup{pdb};
+namespace {
+struct prefetch_image {
+    filesystem::path fn;
+    vector<symbol_location> locations;
+    bool has_pdb = false;
+};
 }
 
-static void load_file(const string& fn) {
-    bfdup b;
+// Fetches the PDBs for all the PE images under dir into the cache, so that later runs don't
+// have to wait for them.
+static bool run_prefetch(const filesystem::path& dir, const options& opts) {
+    vector<prefetch_image> images;
+    bool walk_failed = false;
 
     {
-        auto arch = bfd_openr(fn.c_str(), nullptr);
+        error_code ec;
+        filesystem::recursive_directory_iterator it(dir, filesystem::directory_options::skip_permission_denied, ec);
+
+        // an error ends the walk, but we still fetch for what we've found so far
+
+        while (!ec && it != filesystem::recursive_directory_iterator()) {
+            error_code ec2;
 
-        if (!arch)
-            throw formatted_error("Could not load PDB file {} ({}).", fn, bfd_errmsg(bfd_get_error()));
+            if (it->is_regular_file(ec2))
+                images.push_back({it->path(), {}});
 
-        b.reset(arch);
+            it.increment(ec);
+        }
+
+        if (ec) {
+            fmt::print(stderr, "Error reading {}: {}\n", dir.string(), ec.message());
+            walk_failed = true;
+        }
+    }
+
+    work_pool pool(opts.num_threads);
+    atomic<size_t> num_pe = 0, skipped = 0;
+
+    for (auto& img : images) {
+        pool.submit([&img, &opts, &num_pe, &skipped]() {
+            try {
+                if (filesystem::file_size(img.fn) < sizeof(IMAGE_DOS_HEADER))
+                    return;
+
+                mapped_file f(img.fn);
+                const auto& dh = *(IMAGE_DOS_HEADER*)f.data().data();
+
+                // not everything in a product drop is a PE image
+                if (dh.e_magic != IMAGE_DOS_SIGNATURE)
+                    return;
+
+                num_pe++;
+
+                img.locations = pdb_locations_for_image(f.data(), opts);
+                img.has_pdb = true;
+            } catch (const exception& e) {
+                fmt::print(stderr, "{}: {}\n", img.fn.string(), e.what());
+                skipped++;
+            }
+        });
     }
 
-    if (bfd_check_format(b.get(), bfd_object)) {
-        auto vec = read_image_rsds(b.get());
+    pool.wait();
+
+    // Several images can share a PDB, so we only fetch each one once.
+
+    vector<shared_ptr<batch_job>> jobs;
+    unordered_set<string> seen;
+
+    for (auto& img : images) {
+        if (!img.has_pdb)
+            continue;
+
+        if (!img.locations.empty() && !seen.insert(img.locations.front().fn.string()).second)
+            continue;
 
-        if (vec.size() < offsetof(CV_INFO_PDB70, PdbFileName))
-            throw formatted_error("CV debug info was {} bytes, expected at least {}.", vec.size(), offsetof(CV_INFO_PDB70, PdbFileName));
+        auto job = make_shared<batch_job>();
 
-        const auto& rsds = *(CV_INFO_PDB70*)vec.data();
+        job->input = img.fn.string();
+        job->locations = move(img.locations);
+        job->render = false;
 
-        if (rsds.CvSignature != CVINFO_PDB70_CVSIGNATURE)
-            throw formatted_error("CV signature was {:x}, expected {:x}.", rsds.CvSignature, CVINFO_PDB70_CVSIGNATURE);
+        jobs.push_back(job);
 
-        auto name = string_view(rsds.PdbFileName, vec.size() - offsetof(CV_INFO_PDB70, PdbFileName));
+        pool.submit([&pool, job, &opts]() {
+            batch_locate(pool, job, opts, 0);
+        });
+    }
 
-        if (auto st = name.find('\0'); st != string::npos)
-            name = name.substr(0, st);
+    pool.wait();
 
-        auto pdb = load_pdb(rsds.Signature, rsds.Age, name);
+    size_t hits = 0, misses = 0, failures = 0;
 
-        if (bfd_check_format(pdb.get(), bfd_archive))
-            b.swap(pdb);
+    for (const auto& job : jobs) {
+        if (job->failed)
+            failures++;
+        else if (job->fetched)
+            misses++;
+        else
+            hits++;
     }
 
-    if (!bfd_check_format(b.get(), bfd_archive))
-        throw formatted_error("bfd_check_format failed ({})", bfd_errmsg(bfd_get_error()));
+    fmt::print("{} PE images ({} skipped), {} PDBs: {} already cached, {} fetched, {} failed\n",
+               num_pe.load(), skipped.load(), jobs.size(), hits, misses, failures);
 
-    // FIXME - check format is PDB
+    return failures == 0 && !walk_failed;
+}
 
-    bfd* types_stream = nullptr;
-    unsigned int count = 0;
+static uint64_t parse_size(string_view s) {
+    uint64_t mult = 1;
 
-    for (auto f = bfd_openr_next_archived_file(b.get(), nullptr); f; f = bfd_openr_next_archived_file(b.get(), f)) {
-        if (count == 2) {
-            types_stream = f;
-            break;
+    if (!s.empty()) {
+        switch (toupper(s.back())) {
+            case 'K': mult = 1ull << 10; break;
+            case 'M': mult = 1ull << 20; break;
+            case 'G': mult = 1ull << 30; break;
+            case 'T': mult = 1ull << 40; break;
         }
 
-        count++;
+        if (mult != 1)
+            s.remove_suffix(1);
     }
 
-    if (!types_stream)
-        throw runtime_error("Could not extract types stream 0002.");
+    uint64_t val;
+    auto [ptr, ec] = from_chars(s.data(), s.data() + s.size(), val);
 
-    pdb p(types_stream);
+    if (ec != errc() || ptr != s.data() + s.size())
+        throw formatted_error("Invalid size \"{}\".", s);
 
-    p.extract_types();
+    return val * mult;
 }
 
 int main(int argc, char* argv[]) {
     try {
-        if (argc < 2) {
-            fmt::print(stderr, "Usage: pdbout <PDB file>\n");
-            fmt::print(stderr, "Usage: pdbout <PE image>\n");
+        options opts;
+        vector<string> inputs;
+
+        if (auto s = getenv("PDBDUMP_CACHE_SIZE"); s && *s)
+            opts.cache_size = parse_size(s);
+
+        for (int i = 1; i < argc; i++) {
+            auto arg = string_view(argv[i]);
+
+            if (arg == "--partial")
+                opts.partial_fetch = true;
+            else if (arg == "--no-type-db")
+                opts.use_type_db = false;
+            else if (arg == "--batch")
+                opts.batch = true;
+            else if (arg == "-j" && i + 1 < argc) {
+                opts.num_threads = (unsigned int)stoul(argv[i + 1]);
+                i++;
+            } else if (arg == "-o" && i + 1 < argc) {
+                opts.output_fn = argv[i + 1];
+                i++;
+            } else if (arg == "--cache-size" && i + 1 < argc) {
+                opts.cache_size = parse_size(argv[i + 1]);
+                i++;
+            } else if (arg == "--symbol-path" && i + 1 < argc) {
+                opts.sym_path = argv[i + 1];
+                i++;
+            } else if (arg == "--prefetch" && i + 1 < argc) {
+                opts.prefetch_dir = argv[i + 1];
+                i++;
+            } else if (arg.starts_with("@") && arg.size() > 1) {
+                auto list = read_list_file(arg.substr(1));
+
+                inputs.insert(inputs.end(), list.begin(), list.end());
+            } else
+                inputs.emplace_back(arg);
+        }
+
+        if (opts.prefetch_dir.empty() ? inputs.empty() || (!opts.batch && inputs.size() != 1) : !inputs.empty()) {
+            fmt::print(stderr, "Usage: pdbout [-j <threads>] [-o <file>] [--no-type-db] <PDB file>\n");
+            fmt::print(stderr, "Usage: pdbout [-j <threads>] [-o <file>] [--no-type-db] [--partial] [--symbol-path <path>] <PE image>\n");
+            fmt::print(stderr, "Usage: pdbout --batch [-j <threads>] [-o <dir>] [--no-type-db] [--partial] <file|@list>...\n");
+            fmt::print(stderr, "Usage: pdbout --prefetch <dir> [-j <threads>] [--symbol-path <path>]\n");
+            fmt::print(stderr, "\n");
+            fmt::print(stderr, "  -o <file>       write output to file rather than stdout\n");
+            fmt::print(stderr, "  -j <threads>    number of threads to use for output (default: number of CPUs)\n");
+            fmt::print(stderr, "  --partial       only download the parts of the PDB that are needed\n");
+            fmt::print(stderr, "  --no-type-db    don't read or write the cached type database\n");
+            fmt::print(stderr, "  --symbol-path <path>\n");
+            fmt::print(stderr, "                  where to look for PDBs, in the format of _NT_SYMBOL_PATH, e.g.\n");
+            fmt::print(stderr, "                  cache*/a;srv*/mnt/symstore*https://msdl.microsoft.com/download/symbols\n");
+            fmt::print(stderr, "  --cache-size <size>\n");
+            fmt::print(stderr, "                  evict least recently used PDBs when the cache is bigger than this,\n");
+            fmt::print(stderr, "                  e.g. 50G (default: PDBDUMP_CACHE_SIZE, or no limit)\n");
+            fmt::print(stderr, "  --batch         process several files, writing <dir>/<filename>.h for each\n");
+            fmt::print(stderr, "  @<list>         read further inputs from list, one per line\n");
+            fmt::print(stderr, "  --prefetch <dir>\n");
+            fmt::print(stderr, "                  fetch the PDBs for all the PE images in dir into the cache\n");
             return 1;
         }
 
-        auto fn = string{argv[1]};
+        bool ok = true;
+
+        if (!opts.prefetch_dir.empty())
+            ok = run_prefetch(opts.prefetch_dir, opts);
+        else if (opts.batch)
+            ok = run_batch(inputs, opts);
+        else
+            load_file(inputs.front(), opts);
+
+        if (cache) {
+            try {
+                cache->save();
+            } catch (const exception& e) {
+                fmt::print(stderr, "Could not update cache index: {}\n", e.what());
+            }
+        }
 
-        load_file(fn);
+        if (!ok)
+            return 1;
     } catch (const exception& e) {
         cerr << "Exception: " << e.what() << endl;
         return 1;
@@ -2,20 +2,76 @@
 
 #include <string>
 #include <memory>
+#include <span>
+#include <vector>
+#include <filesystem>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <optional>
+#include <curl/curl.h>
 #include <fmt/format.h>
-#include <bfd.h>
 
-class bfd_closer {
+class mapped_file {
 public:
-    using pointer = bfd*;
+    mapped_file(const std::filesystem::path& fn);
+    ~mapped_file();
+    mapped_file(mapped_file&& other) noexcept;
+    mapped_file& operator=(mapped_file&& other) noexcept;
 
-    void operator()(bfd* b) {
-        if (b)
-            bfd_close(b);
+    std::span<const uint8_t> data() const {
+        return std::span(ptr, len);
     }
+
+private:
+    const uint8_t* ptr = nullptr;
+    size_t len = 0;
+};
+
+class msf_stream {
+public:
+    msf_stream() = default;
+    msf_stream(std::span<const uint8_t> sp) : sp(sp) { }
+    msf_stream(std::vector<uint8_t>&& v) : buf(std::move(v)), sp(buf) { }
+    msf_stream(msf_stream&&) = default;
+    msf_stream& operator=(msf_stream&&) = default;
+
+    std::span<const uint8_t> data() const {
+        return sp;
+    }
+
+private:
+    std::vector<uint8_t> buf; // only used if stream is not contiguous on disk
+    std::span<const uint8_t> sp;
 };
 
-using bfdup = std::unique_ptr<bfd*, bfd_closer>;
+class msf {
+public:
+    msf(mapped_file&& f);
+
+    static bool is_msf(std::span<const uint8_t> data);
+    size_t num_streams() const {
+        return stream_sizes.size();
+    }
+    msf_stream get_stream(uint32_t num) const;
+    std::span<const uint32_t> get_stream_blocks(uint32_t num) const;
+    uint32_t get_block_size() const {
+        return block_size;
+    }
+
+private:
+    msf_stream gather(std::span<const uint32_t> blocks, uint32_t size) const;
+
+    mapped_file f;
+    uint32_t block_size;
+    msf_stream directory;
+    std::span<const uint32_t> stream_sizes;
+    std::vector<std::span<const uint32_t>> stream_blocks;
+};
 
 class formatted_error : public std::exception {
 public:
@@ -31,6 +87,199 @@ private:
     std::string msg;
 };
 
+// thrown by extract_cab for a compression type it can't unpack
+class unsupported_cab_error : public formatted_error {
+public:
+    using formatted_error::formatted_error;
+};
+
+struct symbol_location {
+    std::filesystem::path fn; // for a server, where we download it to
+    std::string url; // empty if local
+    std::string server; // the server's URL, if this is one
+    std::filesystem::path store; // where files from the server go
+    std::string cab_url; // compressed version on a server, if there is one
+    std::vector<std::filesystem::path> write_back; // nearer stores to copy it into if it's found here
+};
+
+// A list of places to look for PDBs, in the format of _NT_SYMBOL_PATH, e.g.
+// "cache*/a;srv*/mnt/symstore*https://msdl.microsoft.com/download/symbols;/some/dir".
+class symbol_path {
+public:
+    symbol_path(std::string_view s, const std::filesystem::path& default_store);
+
+    std::vector<symbol_location> locations(std::string_view name, std::string_view hexstr) const;
+
+private:
+    enum class tier_type {
+        store,
+        flat,
+        server
+    };
+
+    struct tier {
+        tier_type type;
+        std::filesystem::path dir; // for a server, the store we download into
+        std::string url;
+        std::vector<size_t> write_back; // indices of stores nearer than this
+    };
+
+    std::vector<tier> tiers;
+};
+
+// flock on a lock file, which is released when this is destroyed.
+class file_lock {
+public:
+    file_lock() = default;
+    file_lock(const std::filesystem::path& fn);
+    ~file_lock();
+    file_lock(file_lock&& other) noexcept : fn(std::move(other.fn)), fd(other.fd) { other.fd = -1; }
+    file_lock& operator=(file_lock&& other) noexcept;
+
+    bool try_lock(bool exclusive);
+    void lock(bool exclusive);
+
+private:
+    std::filesystem::path fn;
+    int fd = -1;
+};
+
+// Index of what's in our PDB store, kept in <root>/index, so that lookups don't have to touch
+// the filesystem. Entries are the name/hexstr directories, and are evicted least recently used
+// first when the total goes over max_size (0 meaning no limit).
+class pdb_cache {
+public:
+    pdb_cache(const std::filesystem::path& root, uint64_t max_size);
+
+    bool contains(const std::filesystem::path& fn);
+    void add(const std::filesystem::path& fn);
+    std::optional<file_lock> lock_entry(const std::filesystem::path& fn);
+    void save();
+
+private:
+    struct entry {
+        uint64_t size;
+        int64_t last_access;
+        bool dirty = false; // used or added by us, so needs writing back
+    };
+
+    std::optional<std::string> key_for(const std::filesystem::path& fn, bool need_pdb) const;
+    void load();
+    void read_index(std::unordered_map<std::string, entry>& ents) const;
+    void scan(std::unordered_map<std::string, entry>& ents) const;
+    uint64_t dir_size(const std::string& key) const;
+    bool evict(const std::string& key);
+
+    std::filesystem::path root;
+    uint64_t max_size;
+    std::mutex mut;
+    bool loaded = false;
+    std::unordered_map<std::string, entry> entries;
+};
+
+void write_back_pdb(const symbol_location& loc);
+void extract_cab(const std::filesystem::path& cab_fn, const std::filesystem::path& out_fn);
+std::filesystem::path fetch_pdb_streams(const std::string& url, const std::filesystem::path& fn);
+std::span<const uint8_t> read_image_rsds(std::span<const uint8_t> image);
+
+// Thread pool where each worker has its own queue, taking from the back of it and stealing
+// from the front of the others' when it's empty. Tasks submitted from within a task go on the
+// current worker's queue, so work spawned by a big task stays local unless someone's idle.
+class work_pool {
+public:
+    work_pool(unsigned int num_threads);
+    ~work_pool();
+
+    void submit(std::function<void()> func);
+    void wait();
+
+    // Keeps wait() from returning while something outside the pool, such as a download,
+    // is going to submit more work.
+    void hold();
+    void release();
+
+private:
+    struct queue {
+        std::mutex mut;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void worker(unsigned int idx);
+    bool take(unsigned int idx, std::function<void()>& func);
+
+    std::vector<std::unique_ptr<queue>> queues;
+    std::vector<std::jthread> threads;
+    std::mutex mut;
+    std::condition_variable work_cv; // for workers, when something is queued
+    std::condition_variable done_cv; // for wait(), when pending reaches 0
+    size_t queued = 0; // protected by mut
+    size_t pending = 0; // protected by mut, includes running tasks
+    unsigned int next_queue = 0; // protected by mut
+    bool stopping = false;
+    std::exception_ptr exc;
+};
+
+class output_sink {
+public:
+    output_sink() = default; // in-memory
+    output_sink(int fd) : fd(fd) { }
+    output_sink(const std::filesystem::path& fn);
+    ~output_sink();
+    output_sink(const output_sink&) = delete;
+    output_sink& operator=(const output_sink&) = delete;
+
+    void write(fmt::memory_buffer&& buf);
+    void flush();
+
+    std::string_view str() const {
+        return std::string_view(mem.data(), mem.size());
+    }
+
+private:
+    int fd = -1;
+    bool owns_fd = false;
+    std::vector<fmt::memory_buffer> pending;
+    size_t pending_size = 0;
+    fmt::memory_buffer mem; // only used if not writing to a file
+};
+
+// Runs downloads on a single curl multi handle, so they all proceed at once on one thread,
+// sharing connections, DNS lookups, and TLS sessions. There's one per process, which is
+// also where curl gets initialized.
+class download_manager {
+public:
+    using callback = std::function<void(std::exception_ptr)>;
+
+    static download_manager& get();
+    ~download_manager();
+
+    // done is called on the download thread, so should just hand off to somewhere else
+    void start(const std::string& url, const std::filesystem::path& dest, callback done);
+    void download(const std::string& url, const std::filesystem::path& dest);
+    void share(CURL* curl);
+
+private:
+    struct transfer;
+
+    download_manager();
+    void run();
+    void add_transfer(std::unique_ptr<transfer>& t);
+    void finish_transfer(CURL* curl, CURLcode res);
+    static void complete(transfer& t, std::exception_ptr e);
+    static size_t write_cb(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+    CURLM* multi = nullptr;
+    CURLSH* sh = nullptr;
+    std::mutex share_locks[CURL_LOCK_DATA_LAST];
+    std::mutex mut;
+    std::vector<std::unique_ptr<transfer>> queued; // protected by mut
+    std::unordered_map<std::string, transfer*> by_dest; // protected by mut
+    std::unordered_map<CURL*, std::unique_ptr<transfer>> active; // only used by download thread
+    std::vector<std::pair<std::chrono::steady_clock::time_point, std::unique_ptr<transfer>>> waiting; // to be retried
+    bool stopping = false; // protected by mut
+    std::jthread thread;
+};
+
 struct IMAGE_DOS_HEADER {
     uint16_t e_magic;
     uint16_t e_cblp;
@@ -224,6 +473,63 @@ struct CV_INFO_PDB70 {
 
 static constexpr uint32_t CVINFO_PDB70_CVSIGNATURE = 0x53445352;
 
+// from the Microsoft Cabinet Format documentation
+
+static constexpr uint32_t CAB_SIGNATURE = 0x4643534d; // "MSCF"
+
+static constexpr uint16_t cfhdrPREV_CABINET = 0x0001;
+static constexpr uint16_t cfhdrNEXT_CABINET = 0x0002;
+static constexpr uint16_t cfhdrRESERVE_PRESENT = 0x0004;
+
+static constexpr uint16_t tcompMASK_TYPE = 0x000f;
+static constexpr uint16_t tcompTYPE_NONE = 0x0000;
+static constexpr uint16_t tcompTYPE_MSZIP = 0x0001;
+static constexpr uint16_t tcompTYPE_QUANTUM = 0x0002;
+static constexpr uint16_t tcompTYPE_LZX = 0x0003;
+
+#pragma pack(push,1)
+
+struct CFHEADER {
+    uint32_t signature;
+    uint32_t reserved1;
+    uint32_t cbCabinet;
+    uint32_t reserved2;
+    uint32_t coffFiles;
+    uint32_t reserved3;
+    uint8_t versionMinor;
+    uint8_t versionMajor;
+    uint16_t cFolders;
+    uint16_t cFiles;
+    uint16_t flags;
+    uint16_t setID;
+    uint16_t iCabinet;
+    // then cbCFHeader, cbCFFolder, and cbCFData if cfhdrRESERVE_PRESENT set
+};
+
+struct CFFOLDER {
+    uint32_t coffCabStart;
+    uint16_t cCFData;
+    uint16_t typeCompress;
+};
+
+struct CFFILE {
+    uint32_t cbFile;
+    uint32_t uoffFolderStart;
+    uint16_t iFolder;
+    uint16_t date;
+    uint16_t time;
+    uint16_t attribs;
+    char szName[];
+};
+
+struct CFDATA {
+    uint32_t csum;
+    uint16_t cbData;
+    uint16_t cbUncomp;
+};
+
+#pragma pack(pop)
+
 enum class cv_type : uint16_t {
     LF_VTSHAPE = 0x000a,
     LF_MODIFIER = 0x1001,
@@ -395,6 +701,29 @@ struct fmt::formatter<enum cv_type> {
     }
 };
 
+// SuperBlock in llvm/DebugInfo/MSF/MSFCommon.h
+struct msf_superblock {
+    uint8_t magic[32];
+    uint32_t block_size;
+    uint32_t free_block_map_block;
+    uint32_t num_blocks;
+    uint32_t num_directory_bytes;
+    uint32_t unknown;
+    uint32_t block_map_addr;
+};
+
+static constexpr uint8_t msf_magic[] = {
+    'M', 'i', 'c', 'r', 'o', 's', 'o', 'f', 't', ' ', 'C', '/', 'C', '+', '+', ' ',
+    'M', 'S', 'F', ' ', '7', '.', '0', '0', '\r', '\n', 0x1a, 'D', 'S', 0, 0, 0
+};
+
+static constexpr uint32_t MSF_NIL_STREAM_SIZE = 0xffffffff;
+
+static constexpr uint32_t PDB_STREAM_INFO = 1;
+static constexpr uint32_t PDB_STREAM_TPI = 2;
+static constexpr uint32_t PDB_STREAM_DBI = 3;
+static constexpr uint32_t PDB_STREAM_IPI = 4;
+
 // HDR in tpi.h
 struct pdb_tpi_stream_header {
     uint32_t version;
@@ -414,8 +743,67 @@ struct pdb_tpi_stream_header {
     uint32_t hash_adj_buffer_length;
 };
 
+// TI_OFF in tpi.h, the position of every so often type in the records
+struct pdb_tpi_index_offset {
+    uint32_t type_index;
+    uint32_t offset;
+};
+
 static const uint32_t TPI_STREAM_VERSION_80 = 20040203;
 
+// PDBStream in pdb.h
+struct pdb_info_stream_header {
+    uint32_t version;
+    uint32_t signature;
+    uint32_t age;
+    uint8_t guid[16];
+};
+
+// start of NewDBIHdr in dbi.h
+struct pdb_dbi_stream_header {
+    int32_t version_signature;
+    uint32_t version;
+    uint32_t age;
+};
+
+// Our sidecar type database, which lives next to the cached PDB. It's the header, followed by
+// the type record offsets (one more than there are types), the per-type entries, and the name
+// index, each 8-byte aligned.
+
+static constexpr char TYPEDB_MAGIC[8] = { 'P', 'D', 'B', 'D', 'T', 'Y', 'P', 'E' };
+static constexpr uint32_t TYPEDB_VERSION = 1;
+
+struct typedb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t age;
+    uint8_t guid[16];
+    uint32_t tpi_stream_size;
+    uint32_t type_index_begin;
+    uint32_t type_index_end;
+    uint32_t num_names;
+};
+
+static constexpr uint8_t TYPEDB_HAS_NAME = 1;
+static constexpr uint8_t TYPEDB_ANONYMOUS = 2;
+static constexpr uint8_t TYPEDB_HAS_SIZE = 4;
+
+struct typedb_entry {
+    enum cv_type kind;
+    uint8_t flags;
+    uint8_t padding;
+    uint32_t definition;
+    uint64_t size;
+    uint32_t name_offset; // from start of type records
+    uint32_t name_length;
+};
+
+// non-forward structs, classes, and unions, sorted by hash then type
+struct typedb_name {
+    uint32_t hash;
+    uint32_t type;
+};
+
 // lfEnum in cvinfo.h
 struct lf_enum {
     cv_type kind;
@@ -461,6 +849,76 @@ struct lf_member {
     char name[];
 } __attribute__((packed));
 
+// lfBClass in cvinfo.h
+struct lf_bclass {
+    cv_type kind;
+    uint16_t attributes;
+    uint32_t type;
+    uint16_t offset;
+    // then actual value if offset >= 0x8000
+} __attribute__((packed));
+
+// lfVBClass in cvinfo.h, also used for LF_IVBCLASS
+struct lf_vbclass {
+    cv_type kind;
+    uint16_t attributes;
+    uint32_t base_type;
+    uint32_t vbptr_type;
+    uint16_t vbptr_offset;
+    // then actual value if vbptr_offset >= 0x8000, followed by the vbtable index
+} __attribute__((packed));
+
+// lfIndex in cvinfo.h
+struct lf_index {
+    cv_type kind;
+    uint16_t padding;
+    uint32_t type;
+} __attribute__((packed));
+
+// lfVFuncTab in cvinfo.h
+struct lf_vfunctab {
+    cv_type kind;
+    uint16_t padding;
+    uint32_t type;
+} __attribute__((packed));
+
+// lfSTMember in cvinfo.h
+struct lf_stmember {
+    cv_type kind;
+    uint16_t attributes;
+    uint32_t type;
+    char name[];
+} __attribute__((packed));
+
+// lfMethod in cvinfo.h
+struct lf_method {
+    cv_type kind;
+    uint16_t count;
+    uint32_t method_list;
+    char name[];
+} __attribute__((packed));
+
+// lfNestType in cvinfo.h
+struct lf_nesttype {
+    cv_type kind;
+    uint16_t padding;
+    uint32_t type;
+    char name[];
+} __attribute__((packed));
+
+// lfOneMethod in cvinfo.h
+struct lf_onemethod {
+    cv_type kind;
+    uint16_t attributes;
+    uint32_t type;
+    // then uint32_t vtable offset if introducing virtual, then name
+} __attribute__((packed));
+
+// mprop in CV_fldattr_t in cvinfo.h
+#define CV_MPROP_MASK       0x1c
+#define CV_MPROP_INTRO      0x10
+#define CV_MPROP_PUREINTRO  0x18
+
 // lfPointer in cvinfo.h
 struct lf_pointer {
     cv_type kind;
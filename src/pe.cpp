@@ -0,0 +1,88 @@
+#include <string.h>
+#include "pdbdump.h"
+
+using namespace std;
+
+static span<const uint8_t> image_range(span<const uint8_t> image, uint64_t off, uint64_t len) {
+    if (off > image.size() || len > image.size() - off)
+        throw formatted_error("Offset {:x} (length {:x}) was beyond end of image ({:x} bytes).", off, len, image.size());
+
+    return image.subspan((size_t)off, (size_t)len);
+}
+
+static span<const uint8_t> image_rva(span<const uint8_t> image, span<const IMAGE_SECTION_HEADER> sections,
+                                     uint32_t size_of_headers, uint32_t rva, uint32_t len) {
+    if (rva < size_of_headers)
+        return image_range(image, rva, len);
+
+    for (const auto& s : sections) {
+        if (rva < s.VirtualAddress || rva - s.VirtualAddress >= max(s.VirtualSize, s.SizeOfRawData))
+            continue;
+
+        auto off = rva - s.VirtualAddress;
+
+        if ((uint64_t)off + len > s.SizeOfRawData)
+            throw formatted_error("RVA {:x} (length {:x}) was beyond end of raw data for section.", rva, len);
+
+        return image_range(image, (uint64_t)s.PointerToRawData + off, len);
+    }
+
+    throw formatted_error("Could not find section containing RVA {:x}.", rva);
+}
+
+span<const uint8_t> read_image_rsds(span<const uint8_t> image) {
+    if (image.size() < sizeof(IMAGE_DOS_HEADER))
+        throw formatted_error("Image was {} bytes, expected at least {}.", image.size(), sizeof(IMAGE_DOS_HEADER));
+
+    const auto& dh = *(IMAGE_DOS_HEADER*)image.data();
+
+    if (dh.e_magic != IMAGE_DOS_SIGNATURE)
+        throw formatted_error("e_magic was {:04x}, expected {:04x}", dh.e_magic, IMAGE_DOS_SIGNATURE);
+
+    const auto& pe = *(IMAGE_NT_HEADERS*)image_range(image, dh.e_lfanew, sizeof(IMAGE_NT_HEADERS)).data();
+
+    if (pe.Signature != IMAGE_NT_SIGNATURE)
+        throw formatted_error("PE Signature was {:08x}, expected {:08x}", pe.Signature, IMAGE_NT_SIGNATURE);
+
+    span<const IMAGE_DATA_DIRECTORY> dirs;
+    uint32_t size_of_headers;
+
+    if (pe.OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+        dirs = span(pe.OptionalHeader32.DataDirectory, pe.OptionalHeader32.NumberOfRvaAndSizes);
+        size_of_headers = pe.OptionalHeader32.SizeOfHeaders;
+    } else if (pe.OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+        dirs = span(pe.OptionalHeader64.DataDirectory, pe.OptionalHeader64.NumberOfRvaAndSizes);
+        size_of_headers = pe.OptionalHeader64.SizeOfHeaders;
+    } else
+        throw formatted_error("PE Magic was {:04x}, expected {:04x} or {:04x}", pe.OptionalHeader32.Magic,
+                              IMAGE_NT_OPTIONAL_HDR32_MAGIC, IMAGE_NT_OPTIONAL_HDR64_MAGIC);
+
+    if (dirs.size() <= IMAGE_DIRECTORY_ENTRY_DEBUG)
+        throw runtime_error("Image did not contain a IMAGE_DIRECTORY_ENTRY_DEBUG directory.");
+
+    const auto& dd = dirs[IMAGE_DIRECTORY_ENTRY_DEBUG];
+
+    if (dd.Size == 0)
+        throw runtime_error("Image did not contain a IMAGE_DIRECTORY_ENTRY_DEBUG directory.");
+
+    // section table comes straight after the optional header
+
+    auto sect_off = (uint64_t)dh.e_lfanew + offsetof(IMAGE_NT_HEADERS, OptionalHeader32) + pe.FileHeader.SizeOfOptionalHeader;
+    auto sect_data = image_range(image, sect_off, (uint64_t)pe.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER));
+    auto sections = span((const IMAGE_SECTION_HEADER*)sect_data.data(), pe.FileHeader.NumberOfSections);
+
+    auto dir = image_rva(image, sections, size_of_headers, dd.VirtualAddress, dd.Size);
+    auto dbginfo = span((const IMAGE_DEBUG_DIRECTORY*)dir.data(), dir.size() / sizeof(IMAGE_DEBUG_DIRECTORY));
+
+    for (const auto& d : dbginfo) {
+        if (d.Type != IMAGE_DEBUG_TYPE_CODEVIEW)
+            continue;
+
+        if (d.PointerToRawData != 0)
+            return image_range(image, d.PointerToRawData, d.SizeOfData);
+
+        return image_rva(image, sections, size_of_headers, d.AddressOfRawData, d.SizeOfData);
+    }
+
+    throw runtime_error("Image does not contain CodeView debug information.");
+}
@@ -0,0 +1,170 @@
+#include "pdbdump.h"
+
+using namespace std;
+
+// index of the current thread's queue, or -1 if not one of our workers
+static thread_local int worker_index = -1;
+static thread_local const work_pool* worker_pool = nullptr;
+
+work_pool::work_pool(unsigned int num_threads) {
+    if (num_threads == 0)
+        num_threads = 1;
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        queues.emplace_back(make_unique<queue>());
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads.emplace_back([this, i]() {
+            worker(i);
+        });
+    }
+}
+
+work_pool::~work_pool() {
+    {
+        lock_guard lock(mut);
+
+        stopping = true;
+    }
+
+    work_cv.notify_all();
+    threads.clear();
+}
+
+void work_pool::submit(function<void()> func) {
+    unsigned int idx;
+
+    {
+        lock_guard lock(mut);
+
+        if (worker_pool == this)
+            idx = (unsigned int)worker_index;
+        else {
+            idx = next_queue;
+            next_queue = (next_queue + 1) % (unsigned int)queues.size();
+        }
+
+        pending++;
+    }
+
+    {
+        lock_guard lock(queues[idx]->mut);
+
+        queues[idx]->tasks.push_back(move(func));
+    }
+
+    {
+        lock_guard lock(mut);
+
+        queued++;
+    }
+
+    work_cv.notify_one();
+}
+
+bool work_pool::take(unsigned int idx, function<void()>& func) {
+    {
+        auto& q = *queues[idx];
+        lock_guard lock(q.mut);
+
+        if (!q.tasks.empty()) {
+            func = move(q.tasks.back());
+            q.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (unsigned int i = 1; i < queues.size(); i++) {
+        auto& q = *queues[(idx + i) % queues.size()];
+        lock_guard lock(q.mut);
+
+        if (!q.tasks.empty()) {
+            func = move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void work_pool::worker(unsigned int idx) {
+    worker_index = (int)idx;
+    worker_pool = this;
+
+    while (true) {
+        function<void()> func;
+
+        {
+            unique_lock lock(mut);
+
+            work_cv.wait(lock, [&]() { return stopping || queued > 0; });
+
+            if (queued == 0)
+                return;
+
+            queued--;
+        }
+
+        // queued was non-zero, so there's a task somewhere for us
+        while (!take(idx, func)) {
+        }
+
+        try {
+            func();
+        } catch (...) {
+            lock_guard lock(mut);
+
+            if (!exc)
+                exc = current_exception();
+        }
+
+        func = nullptr;
+
+        bool done;
+
+        {
+            lock_guard lock(mut);
+
+            pending--;
+            done = pending == 0;
+        }
+
+        if (done)
+            done_cv.notify_all();
+    }
+}
+
+void work_pool::hold() {
+    lock_guard lock(mut);
+
+    pending++;
+}
+
+void work_pool::release() {
+    bool done;
+
+    {
+        lock_guard lock(mut);
+
+        pending--;
+        done = pending == 0;
+    }
+
+    if (done)
+        done_cv.notify_all();
+}
+
+void work_pool::wait() {
+    unique_lock lock(mut);
+
+    done_cv.wait(lock, [&]() { return pending == 0; });
+
+    if (exc) {
+        auto e = exc;
+
+        exc = nullptr;
+        rethrow_exception(e);
+    }
+}
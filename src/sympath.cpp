@@ -0,0 +1,178 @@
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <optional>
+#include "pdbdump.h"
+
+using namespace std;
+
+static string_view trim(string_view s) {
+    while (!s.empty() && isspace((unsigned char)s.front())) {
+        s.remove_prefix(1);
+    }
+
+    while (!s.empty() && isspace((unsigned char)s.back())) {
+        s.remove_suffix(1);
+    }
+
+    return s;
+}
+
+static vector<string_view> split(string_view s, char c) {
+    vector<string_view> ret;
+
+    while (true) {
+        auto pos = s.find(c);
+
+        ret.push_back(trim(s.substr(0, pos)));
+
+        if (pos == string_view::npos)
+            break;
+
+        s = s.substr(pos + 1);
+    }
+
+    return ret;
+}
+
+static bool is_url(string_view s) {
+    return s.starts_with("http://") || s.starts_with("https://");
+}
+
+static bool starts_with_nocase(string_view s, string_view prefix) {
+    if (s.size() < prefix.size())
+        return false;
+
+    for (size_t i = 0; i < prefix.size(); i++) {
+        if (tolower((unsigned char)s[i]) != prefix[i])
+            return false;
+    }
+
+    return true;
+}
+
+symbol_path::symbol_path(string_view s, const filesystem::path& default_store) {
+    vector<size_t> caches; // cache* entries, which apply to everything after them
+
+    auto path_or_default = [&](string_view p) {
+        return p.empty() ? default_store : filesystem::path{p};
+    };
+
+    for (auto el : split(s, ';')) {
+        if (el.empty())
+            continue;
+
+        if (starts_with_nocase(el, "cache*")) {
+            auto idx = tiers.size();
+
+            tiers.emplace_back(tier_type::store, path_or_default(el.substr(6)), "", caches);
+            caches.push_back(idx);
+            continue;
+        }
+
+        if (!starts_with_nocase(el, "srv*") && !starts_with_nocase(el, "symsrv*")) {
+            if (is_url(el))
+                tiers.emplace_back(tier_type::server, caches.empty() ? default_store : tiers[caches.back()].dir, string{el}, caches);
+            else
+                tiers.emplace_back(tier_type::flat, filesystem::path{el}, "", caches);
+
+            continue;
+        }
+
+        // srv*a*b*url: look in each of a, b, url in turn, copying back into the ones before
+
+        auto parts = split(el, '*');
+
+        parts.erase(parts.begin(), parts.begin() + (starts_with_nocase(el, "symsrv*") ? 2 : 1));
+
+        auto write_back = caches;
+        optional<filesystem::path> last_store;
+
+        for (auto p : parts) {
+            auto idx = tiers.size();
+
+            if (is_url(p)) {
+                auto dest = last_store ? *last_store : caches.empty() ? default_store : tiers[caches.back()].dir;
+
+                tiers.emplace_back(tier_type::server, dest, string{p}, write_back);
+            } else {
+                tiers.emplace_back(tier_type::store, path_or_default(p), "", write_back);
+                write_back.push_back(idx);
+                last_store = tiers.back().dir;
+            }
+        }
+    }
+}
+
+vector<symbol_location> symbol_path::locations(string_view name, string_view hexstr) const {
+    vector<symbol_location> ret;
+
+    auto store_fn = [&](const filesystem::path& dir) {
+        return dir / name / hexstr / name;
+    };
+
+    for (const auto& t : tiers) {
+        symbol_location loc;
+
+        switch (t.type) {
+            case tier_type::store:
+                loc.fn = store_fn(t.dir);
+                break;
+
+            case tier_type::flat:
+                loc.fn = t.dir / name;
+                break;
+
+            case tier_type::server:
+                loc.fn = store_fn(t.dir);
+                loc.server = t.url;
+                loc.store = t.dir;
+                loc.url = fmt::format("{}/{}/{}/{}", t.url.ends_with('/') ? string_view(t.url).substr(0, t.url.size() - 1) : t.url,
+                                      name, hexstr, name);
+
+                // symbol servers can have a CAB-compressed version, with the last letter replaced by an underscore
+                if (!name.ends_with('_')) {
+                    loc.cab_url = loc.url;
+                    loc.cab_url.back() = '_';
+                }
+                break;
+        }
+
+        for (auto idx : t.write_back) {
+            auto fn = store_fn(tiers[idx].dir);
+
+            if (fn != loc.fn && find(loc.write_back.begin(), loc.write_back.end(), fn) == loc.write_back.end())
+                loc.write_back.push_back(fn);
+        }
+
+        ret.push_back(move(loc));
+    }
+
+    return ret;
+}
+
+void write_back_pdb(const symbol_location& loc) {
+    static atomic<unsigned int> tmp_counter = 0;
+
+    for (const auto& fn : loc.write_back) {
+        if (filesystem::exists(fn))
+            continue;
+
+        // copy to a temporary file first, so nobody sees it half-written
+
+        auto tmp_fn = fn;
+
+        tmp_fn += fmt::format(".{}.{}.tmp", getpid(), tmp_counter++);
+
+        try {
+            filesystem::create_directories(fn.parent_path());
+            filesystem::copy_file(loc.fn, tmp_fn);
+            filesystem::rename(tmp_fn, fn);
+        } catch (const exception& e) {
+            error_code ec;
+
+            filesystem::remove(tmp_fn, ec);
+            fmt::print(stderr, "Could not copy {} to {}: {}\n", loc.fn.string(), fn.string(), e.what());
+        }
+    }
+}
@@ -0,0 +1,350 @@
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <fstream>
+#include "../src/pdbdump.h"
+
+using namespace std;
+
+static constexpr size_t BLOCK_SIZE = 32768;
+
+struct cab_options {
+    uint16_t compression = tcompTYPE_MSZIP;
+    bool checksums = true;
+    bool reserve = false;
+    uint32_t prefix = 0; // bytes in the folder before our file
+    uint16_t folder = 0;
+};
+
+static uint32_t checksum(span<const uint8_t> sp, uint32_t csum) {
+    while (sp.size() >= 4) {
+        csum ^= (uint32_t)sp[0] | ((uint32_t)sp[1] << 8) | ((uint32_t)sp[2] << 16) | ((uint32_t)sp[3] << 24);
+        sp = sp.subspan(4);
+    }
+
+    uint32_t rest = 0;
+
+    for (auto b : sp) {
+        rest = (rest << 8) | b;
+    }
+
+    return csum ^ rest;
+}
+
+// Compresses a block as a raw deflate stream which can refer back into the previous one.
+static vector<uint8_t> mszip_block(span<const uint8_t> in, span<const uint8_t> prev) {
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+
+    if (deflateInit2(&strm, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw runtime_error("deflateInit2 failed.");
+
+    if (!prev.empty() && deflateSetDictionary(&strm, prev.data(), (uInt)prev.size()) != Z_OK)
+        throw runtime_error("deflateSetDictionary failed.");
+
+    vector<uint8_t> out(2 + deflateBound(&strm, (uLong)in.size()));
+
+    out[0] = 'C';
+    out[1] = 'K';
+
+    strm.next_in = (Bytef*)in.data();
+    strm.avail_in = (uInt)in.size();
+    strm.next_out = out.data() + 2;
+    strm.avail_out = (uInt)(out.size() - 2);
+
+    auto ret = deflate(&strm, Z_FINISH);
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END)
+        throw runtime_error("deflate failed.");
+
+    out.resize(out.size() - strm.avail_out);
+
+    return out;
+}
+
+// The sample cabinet from the MS-CAB specification, made by makecab: hello.c and welcome.c, stored
+// in one CFDATA block with checksum 30a65abd.
+static const uint8_t makecab_sample[] = {
+    0x4d, 0x53, 0x43, 0x46, 0x00, 0x00, 0x00, 0x00, 0xfd, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x2c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x01, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00,
+    0x22, 0x06, 0x00, 0x00, 0x5e, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x4d, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6c, 0x22, 0xba, 0x59, 0x20, 0x00, 0x68, 0x65, 0x6c, 0x6c,
+    0x6f, 0x2e, 0x63, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x4d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6c, 0x22,
+    0xe7, 0x59, 0x20, 0x00, 0x77, 0x65, 0x6c, 0x63, 0x6f, 0x6d, 0x65, 0x2e, 0x63, 0x00, 0xbd, 0x5a,
+    0xa6, 0x30, 0x97, 0x00, 0x97, 0x00, 0x23, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x20, 0x3c,
+    0x73, 0x74, 0x64, 0x69, 0x6f, 0x2e, 0x68, 0x3e, 0x0d, 0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64,
+    0x20, 0x6d, 0x61, 0x69, 0x6e, 0x28, 0x76, 0x6f, 0x69, 0x64, 0x29, 0x0d, 0x0a, 0x7b, 0x0d, 0x0a,
+    0x20, 0x20, 0x20, 0x20, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x66, 0x28, 0x22, 0x48, 0x65, 0x6c, 0x6c,
+    0x6f, 0x2c, 0x20, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0x21, 0x5c, 0x6e, 0x22, 0x29, 0x3b, 0x0d, 0x0a,
+    0x7d, 0x0d, 0x0a, 0x23, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x20, 0x3c, 0x73, 0x74, 0x64,
+    0x69, 0x6f, 0x2e, 0x68, 0x3e, 0x0d, 0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 0x61,
+    0x69, 0x6e, 0x28, 0x76, 0x6f, 0x69, 0x64, 0x29, 0x0d, 0x0a, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20,
+    0x20, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x66, 0x28, 0x22, 0x57, 0x65, 0x6c, 0x63, 0x6f, 0x6d, 0x65,
+    0x21, 0x5c, 0x6e, 0x22, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0x0d, 0x0a,
+};
+
+static constexpr uint32_t MAKECAB_SAMPLE_CHECKSUM = 0x30a65abd;
+
+static constexpr string_view hello_c = "#include <stdio.h>\r\n\r\nvoid main(void)\r\n{\r\n    printf(\"Hello, world!\\n\");\r\n}\r\n";
+
+template<typename T>
+static void append(vector<uint8_t>& v, const T& t) {
+    v.insert(v.end(), (const uint8_t*)&t, (const uint8_t*)&t + sizeof(T));
+}
+
+static vector<uint8_t> make_cab(span<const uint8_t> file, const cab_options& opts) {
+    static const char name[] = "test.pdb";
+    uint8_t data_reserve = opts.reserve ? 3 : 0;
+    vector<uint8_t> folder_data(opts.prefix, 0xcc);
+    vector<uint8_t> blocks;
+    uint16_t num_blocks = 0;
+
+    folder_data.insert(folder_data.end(), file.begin(), file.end());
+
+    for (size_t off = 0; off < folder_data.size(); off += BLOCK_SIZE) {
+        auto in = span(folder_data).subspan(off, min(BLOCK_SIZE, folder_data.size() - off));
+        vector<uint8_t> comp;
+
+        if (opts.compression == tcompTYPE_MSZIP)
+            comp = mszip_block(in, off == 0 ? span<const uint8_t>() : span(folder_data).subspan(off - BLOCK_SIZE, BLOCK_SIZE));
+        else
+            comp.assign(in.begin(), in.end());
+
+        CFDATA d;
+
+        d.cbData = (uint16_t)comp.size();
+        d.cbUncomp = (uint16_t)in.size();
+        d.csum = opts.checksums ? checksum(span((const uint8_t*)&d.cbData, 4), checksum(comp, 0)) : 0;
+
+        append(blocks, d);
+        blocks.insert(blocks.end(), data_reserve, 0);
+        blocks.insert(blocks.end(), comp.begin(), comp.end());
+        num_blocks++;
+    }
+
+    auto header_len = sizeof(CFHEADER) + (opts.reserve ? 4 + 6 : 0);
+    auto files_off = header_len + sizeof(CFFOLDER) + (opts.reserve ? 2 : 0);
+    auto data_off = files_off + sizeof(CFFILE) + sizeof(name);
+
+    CFHEADER h;
+
+    memset(&h, 0, sizeof(h));
+    h.signature = CAB_SIGNATURE;
+    h.cbCabinet = (uint32_t)(data_off + blocks.size());
+    h.coffFiles = (uint32_t)files_off;
+    h.versionMinor = 3;
+    h.versionMajor = 1;
+    h.cFolders = 1;
+    h.cFiles = 1;
+    h.flags = opts.reserve ? cfhdrRESERVE_PRESENT : 0;
+
+    CFFOLDER folder;
+
+    folder.coffCabStart = (uint32_t)data_off;
+    folder.cCFData = num_blocks;
+    folder.typeCompress = opts.compression;
+
+    CFFILE f;
+
+    f.cbFile = (uint32_t)file.size();
+    f.uoffFolderStart = opts.prefix;
+    f.iFolder = opts.folder;
+    f.date = f.time = 0;
+    f.attribs = 0x20;
+
+    vector<uint8_t> cab;
+
+    append(cab, h);
+
+    if (opts.reserve) {
+        append(cab, (uint16_t)6);
+        cab.push_back(2);
+        cab.push_back(data_reserve);
+        cab.insert(cab.end(), 6, 0);
+    }
+
+    append(cab, folder);
+    cab.insert(cab.end(), opts.reserve ? 2 : 0, 0);
+    append(cab, f);
+    cab.insert(cab.end(), (const uint8_t*)name, (const uint8_t*)name + sizeof(name));
+    cab.insert(cab.end(), blocks.begin(), blocks.end());
+
+    return cab;
+}
+
+// Incompressible bytes, repeated at a distance that puts the matches for the start of each
+// block in the one before it.
+static vector<uint8_t> test_data(size_t len) {
+    vector<uint8_t> v(len);
+    uint32_t seed = 1;
+
+    for (size_t i = 0; i < len; i++) {
+        if (i < 20000) {
+            seed = seed * 1103515245 + 12345;
+            v[i] = (uint8_t)(seed >> 16);
+        } else
+            v[i] = v[i - 20000];
+    }
+
+    return v;
+}
+
+class test_dir {
+public:
+    test_dir() : dir(filesystem::temp_directory_path() / fmt::format("pdbdump-cab-test-{}", getpid())) {
+        filesystem::create_directories(dir);
+    }
+
+    ~test_dir() {
+        error_code ec;
+
+        filesystem::remove_all(dir, ec);
+    }
+
+    filesystem::path dir;
+};
+
+static vector<uint8_t> read_file(const filesystem::path& fn) {
+    ifstream f(fn, ios::binary);
+
+    return vector<uint8_t>(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+}
+
+static void extract(const test_dir& td, span<const uint8_t> cab, span<const uint8_t> expected) {
+    auto cab_fn = td.dir / "test.pd_";
+    auto out_fn = td.dir / "test.pdb";
+
+    {
+        ofstream f(cab_fn, ios::binary | ios::trunc);
+
+        f.write((const char*)cab.data(), (streamsize)cab.size());
+    }
+
+    filesystem::remove(out_fn);
+
+    try {
+        extract_cab(cab_fn, out_fn);
+    } catch (...) {
+        if (filesystem::exists(out_fn) || filesystem::exists(td.dir / "test.pdb.cab.tmp"))
+            throw runtime_error("Output was left behind after failure.");
+
+        throw;
+    }
+
+    if (read_file(out_fn) != vector<uint8_t>(expected.begin(), expected.end()))
+        throw runtime_error("Extracted file did not match.");
+}
+
+static unsigned int failures = 0;
+
+static void test(string_view name, invocable auto func) {
+    try {
+        func();
+        fmt::print("{}: passed\n", name);
+    } catch (const exception& e) {
+        fmt::print(stderr, "{}: FAILED ({})\n", name, e.what());
+        failures++;
+    }
+}
+
+template<typename E = exception>
+static void expect_error(invocable auto func) {
+    try {
+        func();
+    } catch (const E&) {
+        return;
+    }
+
+    throw runtime_error("Expected an error.");
+}
+
+int main() {
+    test_dir td;
+    auto data = test_data(100000);
+
+    test("makecab sample", [&]() {
+        extract(td, makecab_sample, span((const uint8_t*)hello_c.data(), hello_c.size()));
+    });
+
+    test("checksum of makecab sample", [&]() {
+        const auto& folder = *(const CFFOLDER*)(makecab_sample + sizeof(CFHEADER));
+        const auto& d = *(const CFDATA*)(makecab_sample + folder.coffCabStart);
+        auto block = span(makecab_sample).subspan(folder.coffCabStart + sizeof(CFDATA), d.cbData);
+
+        // so that the cabinets we make below have the checksums makecab would give them
+        if (checksum(span((const uint8_t*)&d.cbData, 4), checksum(block, 0)) != MAKECAB_SAMPLE_CHECKSUM)
+            throw runtime_error("Checksum did not match.");
+    });
+
+    test("makecab sample, corrupted", [&]() {
+        vector<uint8_t> cab(begin(makecab_sample), end(makecab_sample));
+
+        // in welcome.c, which we don't extract, so only the checksum can tell us something is wrong
+        cab.back() ^= 1;
+
+        expect_error([&]() { extract(td, cab, span((const uint8_t*)hello_c.data(), hello_c.size())); });
+    });
+
+    test("MSZIP", [&]() {
+        extract(td, make_cab(data, {}), data);
+    });
+
+    test("MSZIP with reserved areas", [&]() {
+        extract(td, make_cab(data, { .reserve = true }), data);
+    });
+
+    test("MSZIP with a file partway through the folder", [&]() {
+        extract(td, make_cab(data, { .prefix = 40000 }), data);
+    });
+
+    test("stored", [&]() {
+        extract(td, make_cab(data, { .compression = tcompTYPE_NONE, .checksums = false, .prefix = 1000 }), data);
+    });
+
+    test("stored, a whole number of blocks", [&]() {
+        auto small = span(data).subspan(0, BLOCK_SIZE * 2);
+
+        extract(td, make_cab(small, { .compression = tcompTYPE_NONE }), small);
+    });
+
+    test("truncated", [&]() {
+        auto cab = make_cab(data, {});
+
+        cab.resize(cab.size() - 100);
+
+        expect_error([&]() { extract(td, cab, data); });
+    });
+
+    test("truncated header", [&]() {
+        auto cab = make_cab(data, {});
+
+        cab.resize(sizeof(CFHEADER) - 1);
+
+        expect_error([&]() { extract(td, cab, data); });
+    });
+
+    test("bad iFolder", [&]() {
+        expect_error([&]() { extract(td, make_cab(data, { .folder = 1 }), data); });
+    });
+
+    test("bad checksum", [&]() {
+        auto cab = make_cab(data, { .compression = tcompTYPE_NONE });
+        const auto& folder = *(const CFFOLDER*)(cab.data() + sizeof(CFHEADER));
+
+        // the data is left alone, so only the checksum can tell us something is wrong
+        cab[folder.coffCabStart + offsetof(CFDATA, csum)] ^= 1;
+
+        expect_error([&]() { extract(td, cab, data); });
+    });
+
+    test("LZX", [&]() {
+        expect_error<unsupported_cab_error>([&]() {
+            extract(td, make_cab(data, { .compression = tcompTYPE_LZX, .checksums = false }), data);
+        });
+    });
+
+    return failures == 0 ? 0 : 1;
+}